@@ -1 +1,801 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
 
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include <functional>
+#include <charconv>
+
+#include "vm.h"
+#include "vm-default.h"
+#include "symbols.h"
+#include "lexer.h"
+#include "object.h"
+#include "linker.h"
+
+using std::istream;
+using std::stringstream;
+using std::string;
+using std::string_view;
+using std::vector;
+using std::unordered_map;
+using std::function;
+
+// it's an assembler for no particular 
+// implementation of the virtual machine
+class assembler
+{
+private:
+  // these are types of statements that are legal
+  // in an assembly file.
+  typedef enum 
+    {
+      MNEM, DW, DS, XADDR, REGS, SCALAR, 
+      CHARS, LABEL, SHORT, NOARGS, CTRLD, A_COMMENT, UNDEFINED
+    } form_type;
+
+  typedef symbol_table::symbol symbol;
+
+  // everything the assembler knows about one name,
+  // indexed by the name's symbol.
+  typedef struct
+  {
+    // grammatical form, if the name is an instruction
+    form_type form;
+    // instruction code; -1 for mnemonics the linker numbers
+    int code;
+    // built-in instructions outlive a unit. Everything
+    // else is forgotten once the unit is assembled.
+    bool builtin;
+    bool touched;
+    // the unit's object symbols for this name, or -1
+    int mnem_sym;
+    int label_sym;
+  } symbol_info;
+
+  symbol_table symbols;
+  vector<symbol_info> info;
+
+  // keywords, interned up front
+  symbol kw_mnem, kw_reg, kw_stack, kw_code;
+  symbol kw_xaddr, kw_regs, kw_scalar, kw_chars, kw_short, kw_noargs;
+
+  // the unit being assembled and the names it has used
+  object_file *obj;
+  vector<symbol> unit_symbols;
+
+  lexer lex;
+  // names defined since the lexer last learned its keywords
+  bool new_keywords;
+
+  symbol_info &
+  info_of( symbol s )
+  {
+    if( static_cast<std::size_t>(s) >= info.size() )
+      {
+	symbol_info blank;
+	blank.form = UNDEFINED;
+	blank.code = 0;
+	blank.builtin = false;
+	blank.touched = false;
+	blank.mnem_sym = -1;
+	blank.label_sym = -1;
+	info.resize( symbols.size(), blank );
+      }
+    return info[s];
+  }
+
+  // info_of, for names the unit is about to give a meaning to
+  symbol_info &
+  touch( symbol s )
+  {
+    symbol_info &i = info_of(s);
+    if( !i.touched )
+      {
+	i.touched = true;
+	unit_symbols.push_back(s);
+      }
+    return i;
+  }
+
+  void
+  forget_unit()
+  {
+    for( symbol s : unit_symbols )
+      {
+	symbol_info &i = info[s];
+	if( !i.builtin )
+	  {
+	    i.form = UNDEFINED;
+	    i.code = 0;
+	  }
+	i.touched = false;
+	i.mnem_sym = -1;
+	i.label_sym = -1;
+      }
+    unit_symbols.clear();
+  }
+
+  // object symbol for a label, which is an import
+  // until the unit defines it
+  int
+  label_sym( symbol name )
+  {
+    symbol_info &i = touch(name);
+    if( i.label_sym < 0 )
+      {
+	object_file::symbol o;
+	o.name = string( symbols.name(name) );
+	o.kind = object_file::sym_label;
+	o.defined = false;
+	o.value = 0;
+	o.form = form_noargs;
+	i.label_sym = obj->symbols.size();
+	obj->symbols.push_back(o);
+      }
+    return i.label_sym;
+  }
+
+  // the next word emitted needs patching by the linker
+  void
+  relocate_next( object_file::reloc_kind kind, int sym )
+  {
+    object_file::relocation r;
+    r.offset = obj->code.size();
+    r.kind = kind;
+    r.sym = sym;
+    obj->relocations.push_back(r);
+  }
+
+  // add an instruction to the unit; name is its mnemonic
+  void
+  emit( symbol name, vm::instruction ins )
+  {
+    symbol_info &i = info[name];
+    if( i.code < 0 )
+      relocate_next( object_file::rel_opcode, i.mnem_sym );
+    obj->code.push_back( vm::int32(ins) );
+  }
+  
+  static string error_prefix( token t )
+  {
+    stringstream s;
+    s << t.line << "," << t.col << " : ";
+    return s.str();
+  }
+
+  string_view expect( token t, string_view value )
+  {
+    if( t.content != value )
+      {
+	stringstream ss( error_prefix(t) );
+	ss << "Expected " << value << ".";
+	throw runtime_error( ss.str());
+      }
+    return t.content;
+  }
+
+  string_view expect( token t, token_type type )
+  {
+    if( t.type != type )
+      {
+	stringstream ss; ss <<  error_prefix(t) ;
+	ss << "Expected " << token_type_name(type) << " but got " << "'" << t.content << "'";
+	throw runtime_error(ss.str());
+      }
+    return t.content;
+  }
+
+  // take a type name and return a corresponding form_type
+  form_type
+  typify( token t )
+  {
+    symbol tn(t.sym);
+
+    if( tn==kw_xaddr )     return XADDR;
+    if( tn==kw_regs )      return REGS;
+    if( tn==kw_scalar )    return SCALAR;
+    if( tn==kw_chars )     return CHARS;
+    if( tn==kw_short )     return SHORT;
+    if( tn==kw_noargs )    return NOARGS;
+    
+    stringstream ss( error_prefix(t) );
+    ss << "Expected form type name.";
+    throw runtime_error(ss.str());
+  }
+
+  unsigned char  
+  parse_mod()
+  {
+    symbol mod = lex.peek(0).sym;
+    char segno = 0;
+    if( mod==kw_code ) segno=mod_code;
+    else if( mod==kw_stack ) segno=mod_sv;
+    else if( mod==kw_reg ) segno=mod_rv;
+    else
+      throw runtime_error( "Invalid addressing mode" );
+    lex.next_token();
+    return segno;
+  }  
+
+  int
+  intify( string_view n )
+  {
+    int v(0);
+    std::from_chars( n.data(), n.data()+n.size(), v );
+    return v;
+  }
+
+  template<class T>
+  vector<T>
+  list_of( function< T(token) > f )
+  {
+    vector<T> ts;
+    token t = lex.next_token();
+    ts.push_back(f(t));
+    t = lex.peek(0);
+    while( t.content == "," )
+      {
+	lex.next_token(); // comma
+	
+	t = lex.next_token();
+	ts.push_back( f(t) );
+
+	t = lex.peek(0);
+      }
+    expect( lex.next_token(), ";" );
+    return ts;
+  }
+
+  // Mnem ::= "mnem" kw(CODE) FORM0, FORM1, FORM2 ;
+  void parse_mnem()
+  {
+    vector<form_type> fs;
+    symbol name;
+    int code;
+
+    expect( lex.next_token(), "mnem" );
+    token t = lex.next_token();
+    expect( t, ID );
+    name = t.sym;
+    expect( lex.next_token(), "(" );
+    
+    token cp_p( lex.next_token() );
+    if(cp_p.content==")")
+      {
+	// numbered when linked
+	code = -1;
+      }
+    else
+      {
+	code = intify( expect(cp_p, INTEGER ) );
+	expect( lex.next_token(), ")" );
+      }
+    
+    
+    //    fs = list_of<form_type>( typify,s );
+    
+   
+    form_type form = typify( lex.next_token() );
+    expect( lex.next_token(), ";" );
+    symbol_info &i = touch(name);
+    if( i.builtin )
+      {
+	stringstream ss; ss << error_prefix(t);
+	ss << "Cannot redeclare built-in instruction '" << t.content << "'.";
+	throw runtime_error(ss.str());
+      }
+    i.form = form;
+    i.code = code;
+
+    object_file::symbol o;
+    o.name = string( t.content );
+    o.kind = object_file::sym_mnem;
+    o.defined = true;
+    o.value = code;
+    o.form = argument_form(form);
+    i.mnem_sym = obj->symbols.size();
+    obj->symbols.push_back(o);
+
+    //    std::cout << name << " is now defined.\n";
+  }
+
+  // we can do reg:n, [reg:n], stack:n, [stack:n]
+  void parse_reg( unsigned char &seg, unsigned short &ind )
+  {
+    token t0 = lex.peek(0);
+    token t1 = lex.peek(1);
+    if( t0.type == ID )
+      {
+
+      
+	if( t0.sym==kw_reg )
+	  {
+	    lex.next_token(); // "reg"
+	    expect(lex.next_token(),":"); // ":"
+	    seg = mod_rv;
+	    ind = intify( expect( lex.next_token(), INTEGER ) );
+	    return;
+	  }
+	else if( t0.sym==kw_stack )
+	  {
+	    lex.next_token(); // "stack"
+	    expect(lex.next_token(),":"); // ":"
+	    seg = mod_sv;
+	    ind = intify( expect( lex.next_token(), INTEGER ) );
+	    return;
+	  }
+       
+      }
+    else if( t0.content == "[" )
+      {
+	lex.next_token(); // "["
+	if( t1.sym==kw_reg )
+	  {
+	    lex.next_token(); // "reg"
+	    expect(lex.next_token(), ":" );
+	    seg = mod_ra;
+	    ind = intify( expect( lex.next_token(), INTEGER ) );
+	    expect(lex.next_token(),"]");
+	    return;
+	  }
+	else if( t1.sym==kw_stack )
+	  {
+	    lex.next_token(); // "stack";
+	    expect( lex.next_token(), ":" );
+	    seg = mod_sa;
+	    ind = intify( expect( lex.next_token(), INTEGER ) );
+	    expect( lex.next_token(), "]");
+	    return;
+	  }
+      }
+    throw runtime_error("Invalid register specification.");
+  }
+
+  void parse_regs()
+  {
+    unsigned char mod;
+    unsigned short addr;
+    vm::instruction code;
+    
+    symbol name = lex.next_token().sym;
+    code.instr = info[name].code;
+
+    parse_reg( mod, addr );
+    code.src = addr;
+    code.src_mod = mod;
+    expect(lex.next_token(), "," );
+    parse_reg( mod, addr );
+    code.dst = addr;
+    code.dst_mod = mod;
+    expect( lex.next_token(), ";" );
+
+    emit( name, code );
+  }
+
+  void define_label( symbol name )
+  {
+    object_file::symbol &o = obj->symbols[ label_sym(name) ];
+    if( o.defined )
+      throw runtime_error("Label " + o.name + " is defined twice.");
+    o.defined = true;
+    o.value = obj->code.size();
+  }
+
+  void parse_label()
+  {
+    token name = lex.next_token();
+    expect( lex.next_token(), ":" );
+    define_label( name.sym );
+  }
+
+  // the argument is a number or a label
+  void parse_short()
+  {
+    token name = lex.next_token();
+    token arg = lex.next_token();
+    short v(0);
+    if( arg.type == ID )
+      relocate_next( object_file::rel_short, label_sym(arg.sym) );
+    else
+      v = intify(expect( arg, INTEGER ) );
+    expect( lex.next_token(), ";" );
+    emit( name.sym, vm::assemble( info[name.sym].code, v ) );
+    
+  }
+
+
+
+  void 
+  parse_xaddr()
+  {
+    token name = lex.next_token();
+    bool address(false);
+    
+    if( lex.peek(0).content=="[" )
+      {
+	lex.next_token();
+	address=true;
+      }
+    
+    
+
+    unsigned char segno(parse_mod());
+   
+    token p_plus = lex.peek(0);
+    
+    while( p_plus.content=="+" )
+      {
+	// eat "+"
+	lex.next_token();
+	segno |= parse_mod();
+	p_plus = lex.peek(0);
+      }
+    
+    expect( lex.next_token(), ":" );
+    token loc = lex.next_token();
+    short v(0);
+    if( loc.type == ID )
+      relocate_next( object_file::rel_xaddr, label_sym(loc.sym) );
+    else
+      v = intify( expect( loc, INTEGER ) );
+    
+
+    
+    if( address )
+      {
+	segno += mod_ra;
+	expect( lex.next_token(), "]" );
+      }
+    expect( lex.next_token(), ";" );    
+    emit( name.sym, vm::assemble_xaddr( info[name.sym].code, segno, v ) );
+  }
+
+  void
+  parse_chars()
+  {
+   
+    token name = lex.next_token();
+
+    token t0 = lex.peek(0);
+    
+    if( t0.type == S_STRING )
+      {
+	string_view v = expect( lex.next_token(), S_STRING );
+	if( v.size() != 2 )
+	  throw runtime_error("Too many characters in character constant." );
+	char c0 = v[0];
+	char c1 = v[1];
+	expect( lex.next_token(), ";" );
+	emit( name.sym, vm::assemble( info[name.sym].code, c0, c1 ) );
+      }
+    else if( t0.type==INTEGER )
+      {
+	char c0 = static_cast<char>(intify( expect(lex.next_token(),INTEGER) ));
+	expect( lex.next_token(), ",");
+	char c1 = static_cast<char>(intify( expect(lex.next_token(),INTEGER) ));
+	expect( lex.next_token(), ";" );
+	emit( name.sym, vm::assemble( info[name.sym].code, c0, c1 ) );
+      }
+    else
+      {
+	throw runtime_error("Invalid form for 'chars'.");
+      }
+  }
+  
+  // ('[') xsegment : address (']'), n
+  void
+  parse_scalar()
+  {
+    token name = lex.next_token();
+    
+    token t0 = lex.peek(0);
+
+    bool address = false;
+    char mod = 0;
+    int addr = 0;
+    int len = 0;
+    
+
+    if( t0.content=="[" )
+      {
+	address = true;
+	lex.next_token(); // consume open bracket
+      }
+    mod = parse_mod();
+    
+    while( lex.peek(0).content=="+" )
+      {
+	mod += parse_mod();
+      }
+    
+
+    expect( lex.next_token(), ":" );
+
+    addr = intify(expect(lex.next_token(),INTEGER));
+
+    if( address )
+      {						
+	mod |= 1;
+	expect( lex.next_token(), "]");
+      }
+
+    expect( lex.next_token(), "," );
+    
+    len = intify( expect( lex.next_token(), INTEGER ) );
+    expect( lex.next_token(), ";" );
+    
+    emit( name.sym, vm::assemble_scalar( info[name.sym].code, mod, addr, len ) );
+    
+  }
+
+  void
+  parse_noargs()
+  {
+    token name = lex.next_token();
+    expect( lex.next_token(), ";" );
+    emit( name.sym, vm::assemble( info[name.sym].code ) );
+  }
+
+  static form_type
+  statement_form( arg_form f )
+  {
+    switch( f )
+      {
+      case form_noargs: return NOARGS;
+      case form_short:  return SHORT;
+      case form_chars:  return CHARS;
+      case form_regs:   return REGS;
+      case form_xaddr:  return XADDR;
+      case form_scalar: return SCALAR;
+      }
+    throw runtime_error("Unknown argument form.");
+  }
+
+  static arg_form
+  argument_form( form_type f )
+  {
+    switch( f )
+      {
+      case NOARGS: return form_noargs;
+      case SHORT:  return form_short;
+      case CHARS:  return form_chars;
+      case REGS:   return form_regs;
+      case XADDR:  return form_xaddr;
+      case SCALAR: return form_scalar;
+      default:
+	throw runtime_error("Not an argument form.");
+      }
+  }
+
+public:
+
+  assembler( )
+  : obj(nullptr), lex(symbols), new_keywords(true)
+  {
+
+    kw_mnem   = symbols.intern("mnem");
+    kw_reg    = symbols.intern("reg");
+    kw_stack  = symbols.intern("stack");
+    kw_code   = symbols.intern("code");
+    kw_xaddr  = symbols.intern("xaddr");
+    kw_regs   = symbols.intern("regs");
+    kw_scalar = symbols.intern("scalar");
+    kw_chars  = symbols.intern("chars");
+    kw_short  = symbols.intern("short");
+    kw_noargs = symbols.intern("noargs");
+  }
+
+  // declare an instruction, as a 'mnem' statement would
+  void
+  define_mnemonic( string_view name, int code, arg_form form )
+  {
+    symbol_info &i = info_of( symbols.intern(name) );
+    i.form = statement_form(form);
+    i.code = code;
+    i.builtin = true;
+    new_keywords = true;
+  }
+
+
+  form_type 
+  classify()
+  {
+    token t0 = lex.peek(0); if( t0.type == END_OF_FILE ) return CTRLD;
+    token t1 = lex.peek(1);
+
+    //    std::cout << "Classify (" << t0.content << "," << t1.content << ")\n";
+
+    if( t0.sym==kw_mnem )
+      {
+	return MNEM;
+      }
+    else if( (t0.type == ID) && (t1.content == ":" ))
+      {
+	return LABEL;
+      }
+    else if( t0.type == ID )
+      {
+	form_type f = info_of(t0.sym).form;
+	if( f==UNDEFINED )
+	  {
+	    std::stringstream er;
+	    er << error_prefix(t0) << "Undefined instruction \"" << t0.content << "\".";
+	    throw runtime_error(er.str());
+	  }
+	else
+	  return f;
+	
+      }
+    else if( t0.type == END_OF_FILE )
+      {
+	return CTRLD;
+      }
+    else if( t0.type == COMMENT )
+      {
+	return A_COMMENT;
+      }
+    else
+      {
+	std::stringstream er;
+	er << error_prefix(t0) << "Could not classify your statement.";
+	throw runtime_error(er.str());
+      }
+    
+  
+  }
+
+  
+
+  // assemble text held in memory into an object. Tokens refer into
+  // text rather than copying it, so it must stay put until this returns.
+  void
+  assemble( object_file &o, string_view text )
+  {
+    forget_unit();
+    obj = &o;
+    if( new_keywords )
+      {
+	// built-in mnemonics and keywords come out of the lexer
+	// already interned
+	lex.keywords();
+	new_keywords = false;
+      }
+    lex.reset( text );
+    bool running(true);
+
+    while( running )
+      {
+       
+	switch( classify() )
+	  {
+	  case MNEM:
+	    parse_mnem();
+	    break;
+	  case LABEL:
+	    {
+	      parse_label();
+	    }
+	    break;
+	  case REGS:
+	    parse_regs();
+	    break;
+	  case CTRLD:	   
+	    running = false;
+	    break;
+	  case SHORT:
+	    parse_short();
+	    break;
+	  case XADDR:
+	    parse_xaddr();
+	    break;
+	  case CHARS:
+	    parse_chars();
+	    break;
+	  case NOARGS:
+	    parse_noargs();
+	    break;
+	  case SCALAR:
+	    parse_scalar();
+	    break;
+	  case A_COMMENT:
+	    lex.next_token();
+	    break;
+	  default:
+	    throw runtime_error("I didn't get that.");
+	  }
+      }
+    lex.reset();
+    forget_unit();
+    obj = nullptr;
+  }
+
+  void
+  assemble( object_file &o, istream &s )
+  {
+    source src(s);
+    assemble( o, src.text() );
+  }
+
+  void
+  assemble_file( object_file &o, string const &path )
+  {
+    source src(path);
+    assemble( o, src.text() );
+  }
+
+  // assemble a single unit into code meant to be loaded at base,
+  // without touching any machine. Mnemonics the unit declares
+  // without a code are numbered from first_code.
+  linked_program
+  assemble_detached( string_view text, int base, int first_code, int words = VM_SIZE )
+  {
+    vector<object_file> objects(1);
+    assemble( objects[0], text );
+    return link( objects, base, first_code, words );
+  }
+
+  // assemble a single unit straight into a machine at W. The
+  // result says where its labels ended up.
+  template<unsigned Words, class Segment>
+  linked_program
+  assemble( basic_vm<Words,Segment> &machine, string_view text )
+  {
+    linked_program p( assemble_detached( text, machine.W(), machine.extensions.size(), Words ) );
+    load( machine, p );
+    return p;
+  }
+
+  template<unsigned Words, class Segment>
+  linked_program
+  assemble( basic_vm<Words,Segment> &machine, istream &s )
+  {
+    source src(s);
+    return assemble( machine, src.text() );
+  }
+
+  template<unsigned Words, class Segment>
+  linked_program
+  assemble_file( basic_vm<Words,Segment> &machine, string const &path )
+  {
+    source src(path);
+    return assemble( machine, src.text() );
+  }
+};
+
+// declare the default machine's instructions
+inline void
+declare_builtins( assembler &a )
+{
+  for( const builtin &b : builtins )
+    {
+      a.define_mnemonic( b.name, b.code, b.form );
+    }
+}
+
+// for programs generated at run time: assemble text into a default
+// machine at W, e.g.
+//
+//   vm machine( create_default_vm() );
+//   int entry = assemble_string( machine, source ).labels["main"];
+template<unsigned Words, class Segment>
+linked_program
+assemble_string( basic_vm<Words,Segment> &machine, string_view text )
+{
+  assembler a;
+  declare_builtins(a);
+  return a.assemble( machine, text );
+}
+
+// the same, into a detached buffer to be loaded at base later
+inline linked_program
+assemble_string( string_view text, int base = 0 )
+{
+  assembler a;
+  declare_builtins(a);
+  return a.assemble_detached( text, base, builtin_count );
+}
+
+#endif
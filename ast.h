@@ -2,56 +2,117 @@
 #define AST_H
 
 #include <string>
-#include <sstream>
-#include <memory>
+#include <string_view>
+#include <vector>
+#include <cstdint>
 #include <stdexcept>
 
 using std::runtime_error;
 using std::string;
-using std::stringstream;
-using std::unique_ptr;
+using std::string_view;
+using std::vector;
 
-class expr
-{
- public:
-  virtual string
-    string_value() const =0;
+// the syntax tree of a program. Nodes live in one arena and refer
+// to each other by index, so a tree is a few flat vectors however
+// many nodes it has: no node is allocated or freed on its own, and
+// the whole tree goes at once.
+typedef uint32_t node_id;
+
+// no node; index 0 is never a real node
+const node_id NO_NODE(0);
 
-  virtual int 
-    int_value() const
+typedef enum
   {
-    throw runtime_error("Expression is not an integer.");
-  }
-  
-};
+    n_integer,  // value
+    n_variable, // value is the name's symbol
+    n_unary,    // op a
+    n_binary,   // a op b
+    n_assign,   // variable value = a
+    n_print,    // a, its items chained through next
+    n_string,   // text(value) as a print item
+    n_if,       // if a then b else c
+    n_while,    // while a do b
+    n_block,    // a, its statements chained through next
+    n_halt
+  } node_kind;
 
-class integer
-: public expr
+// operators, as written
+typedef enum
+  {
+    op_none, op_neg, op_add, op_sub, op_mul, op_div, op_and, op_or,
+    op_eq, op_ne, op_lt, op_gt, op_le, op_ge
+  } node_op;
+
+typedef struct
+{
+  uint8_t kind;
+  uint8_t op;
+  uint16_t line;
+  int32_t value;
+  node_id a, b, c;
+  // the next statement of a block, or item of a print
+  node_id next;
+} node;
+
+class ast
 {
+  vector<node> nodes;
+  // the text of every string literal, end to end
+  string strings;
+  vector<uint32_t> string_starts;
+
  public:
-  int value;
+  node_id root;
+
+  ast()
+    : nodes(1), string_starts(1,0), root(NO_NODE)
+  {}
 
-  virtual string
-    string_value() const
+  node_id
+    add( node_kind kind, int line, int32_t value = 0,
+	 node_id a = NO_NODE, node_id b = NO_NODE, node_id c = NO_NODE )
   {
-    stringstream ss;
-    ss << value;
-    return ss.str();
+    node n;
+    n.kind = kind;
+    n.op = op_none;
+    n.line = line;
+    n.value = value;
+    n.a = a;
+    n.b = b;
+    n.c = c;
+    n.next = NO_NODE;
+    nodes.push_back(n);
+    return nodes.size()-1;
   }
 
-  virtual int
-    int_value() const { return value; }
-  
-};
+  node_id
+    add_op( node_kind kind, node_op op, int line, node_id a, node_id b = NO_NODE )
+  {
+    node_id n( add( kind, line, 0, a, b ) );
+    nodes[n].op = op;
+    return n;
+  }
 
-class binary_operator
-: public expr
-{
-  unique_ptr<expr> lhs;
-  unique_ptr<expr> rhs;
-  
-};
+  // a string literal's node; its value numbers the text
+  node_id
+    add_string( string_view text, int line )
+  {
+    strings.append( text.data(), text.size() );
+    string_starts.push_back( strings.size() );
+    return add( n_string, line, string_starts.size()-2 );
+  }
 
+  node & operator[]( node_id n ) { return nodes[n]; }
+  node const & operator[]( node_id n ) const { return nodes[n]; }
 
+  string_view
+    text( node_id n ) const
+  {
+    uint32_t s( nodes[n].value );
+    return string_view( strings ).substr( string_starts[s], string_starts[s+1]-string_starts[s] );
+  }
+
+  std::size_t size() const { return nodes.size()-1; }
+};
 
 #endif
@@ -0,0 +1,73 @@
+#ifndef AUTOMATA_H
+#define AUTOMATA_H
+
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <filesystem>
+#include <algorithm>
+#include <cstdlib>
+
+#include "dfa.h"
+
+using std::vector;
+using std::string;
+using std::runtime_error;
+
+// the automata a guest has loaded with dfa-load, by handle. Handles
+// count from 1, so 0 can stand for failure. Each one is a table that
+// compiled_dfa::save wrote, mapped rather than read, so guests on
+// the same host share it. Only their headers are checked, so they
+// start at once; run_automaton bounds every step instead.
+//
+// Guests name the files, so they may only load ones under one
+// directory: H64K_DFA_DIR if it is set, else the directory the
+// machine was made in.
+class guest_automata
+{
+  vector<compiled_dfa> loaded;
+  std::filesystem::path directory;
+
+ public:
+  // at most this many at once, so handles fit anywhere a short does
+  static constexpr unsigned max_handles = 1024;
+
+  guest_automata()
+  {
+    const char *d( std::getenv("H64K_DFA_DIR") );
+    allow( d && *d ? d : "." );
+  }
+
+  // load only from under d
+  void
+    allow( string const &d )
+  {
+    directory = std::filesystem::weakly_canonical( std::filesystem::absolute(d) );
+  }
+
+  int
+    load( string const &name )
+  {
+    if( loaded.size() >= max_handles )
+      throw runtime_error("Too many automata loaded.");
+    // with links and .. resolved, so neither leads out
+    std::error_code e;
+    std::filesystem::path p( std::filesystem::weakly_canonical( directory / name, e ) );
+    if( e || std::mismatch( directory.begin(), directory.end(), p.begin(), p.end() ).first != directory.end() )
+      throw runtime_error(name + " is not under " + directory.string() + ".");
+    loaded.push_back( compiled_dfa::map_file( p.string() ) );
+    return loaded.size();
+  }
+
+  compiled_dfa const &
+    get( int handle ) const
+  {
+    if( handle < 1 || unsigned(handle) > loaded.size() )
+      throw runtime_error("No such automaton.");
+    return loaded[handle-1];
+  }
+
+  void clear() { loaded.clear(); }
+};
+
+#endif
@@ -0,0 +1,331 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+
+#include "vm.h"
+#include "vm-default.h"
+#include "assembler.h"
+#include "dfa.h"
+#include "bench.h"
+
+using std::string;
+using std::vector;
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+// what the compiler may not throw away
+volatile int sink;
+
+// executions per call of a machine benchmark, so that calling
+// through the harness costs little next to what is measured
+const unsigned repeat( 1000 );
+
+// the same machine every benchmark starts from: registers A and B
+// hold small numbers, Y and Z point well inside their segments, and
+// SP is mid-stack so that returns and pushes stay in bounds
+vm
+bench_machine()
+{
+  vm machine( create_default_vm<vm>() );
+  machine *= vm::assemble(builtin_code("reset"));
+  machine.SP() = vm::size/2;
+  machine.A() = 7;
+  machine.B() = 3;
+  machine.Y() = 100;
+  machine.Z() = 100;
+  machine.stack[10] = 200;
+  machine.stack[ machine.SP()+3 ] = 300;
+  return machine;
+}
+
+// the cost of executing one instruction of each kind that can run
+// over and over on its own. IP, SP, A and B are put back before each
+// one; dispatch/overhead is the cost of that alone.
+void
+dispatch( bench_suite &s )
+{
+  static const char *const ops[] =
+    {
+      "push-l", "push-a", "pop-a", "add-r", "sub-r", "mul-r", "div-r",
+      "and-r", "or-r", "cmp-r", "j-e", "jmp-l", "setw-l", "call-l",
+      "call-x", "return-l", "return-x", "return", "j-x", "inc-x",
+      "dec-x", "rsh", "lsh"
+    };
+  vm machine( bench_machine() );
+  int sp( machine.SP() );
+  auto restore = [&]()
+    {
+      machine.IP() = 64;
+      machine.SP() = sp;
+      machine.A() = 7;
+      machine.B() = 3;
+    };
+
+  s.run( "dispatch/overhead", "op", repeat, [&]()
+	 {
+	   for( unsigned i=0; i<repeat; ++i ) restore();
+	   sink = machine.A();
+	 } );
+
+  for( const char *name : ops )
+    {
+      unsigned short code( builtin_code(name) );
+      vm::instruction ins;
+      switch( builtins[code].form )
+	{
+	case form_regs:
+	  ins = vm::assemble(code);
+	  ins.src = 6;
+	  ins.dst = 5;
+	  break;
+	case form_xaddr:
+	  ins = vm::assemble_xaddr( code, mod_rv, 5 );
+	  break;
+	case form_scalar:
+	  ins = vm::assemble_scalar( code, mod_rv, 5, 1 );
+	  break;
+	case form_short:
+	  // 8 is register C, so pop-a leaves SP alone
+	  ins = vm::assemble( code, (unsigned short)8 );
+	  break;
+	default:
+	  ins = vm::assemble(code);
+	}
+      s.run( string("dispatch/") + name, "op", repeat, [&]()
+	     {
+	       for( unsigned i=0; i<repeat; ++i )
+		 {
+		   restore();
+		   machine *= ins;
+		 }
+	       sink = machine.A();
+	     } );
+    }
+}
+
+// each way an operand finds its word
+void
+lookups( bench_suite &s )
+{
+  static const struct { const char *name; unsigned short address; unsigned char mode; } modes[] =
+    {
+      { "rv", 5, mod_rv }, { "rv-y", 70, mod_rv }, { "ra", 10, mod_ra },
+      { "sv", 3, mod_sv }, { "sa", 3, mod_sa },
+      { "code-rv", 5, mod_code+mod_rv }, { "code-ra", 10, mod_code+mod_ra },
+      { "code-sv", 3, mod_code+mod_sv }, { "code-sa", 3, mod_code+mod_sa }
+    };
+  vm machine( bench_machine() );
+  for( auto const &m : modes )
+    {
+      // read through volatiles, so the switch on mode stays in the loop
+      volatile unsigned short address( m.address );
+      volatile unsigned char mode( m.mode );
+      s.run( string("lookup/") + m.name, "op", repeat, [&]()
+	     {
+	       int sum(0);
+	       for( unsigned i=0; i<repeat; ++i )
+		 sum += machine.lookup( address, mode );
+	       sink = sum;
+	     } );
+    }
+}
+
+// calling a lambda whose body is one inc-x, and returning from it;
+// dispatch/inc-x is the body on its own
+void
+lambdas( bench_suite &s )
+{
+  vm machine( bench_machine() );
+  machine.program[0] = vm::int32( vm::assemble( builtin_code("lambda-l"), (unsigned short)2 ) );
+  machine.program[1] = vm::int32( vm::assemble_xaddr( builtin_code("inc-x"), mod_rv, 6 ) );
+  machine.program[2] = vm::int32( vm::assemble( builtin_code("return") ) );
+  machine.IP() = 0;
+  machine *= vm::to_instruction( machine.program[0] );
+  vm::instruction call( vm::assemble( (unsigned short)(machine.extensions.size()-1) ) );
+  int sp( machine.SP() );
+
+  s.run( "lambda/call-return", "op", repeat, [&]()
+	 {
+	   for( unsigned i=0; i<repeat; ++i )
+	     {
+	       machine.IP() = 64;
+	       machine.SP() = sp;
+	       machine *= call;
+	     }
+	   sink = machine.B();
+	 } );
+}
+
+// writing and reading a whole image, through the file system
+void
+images( bench_suite &s )
+{
+  if( !s.wanted("image/") ) return;
+  string name( (std::filesystem::temp_directory_path() / "h64k-bench.b64").string() );
+  vm machine( bench_machine() );
+  for( unsigned i=0; i<vm::size; ++i )
+    machine.program[i] = i*2654435761u;
+  machine.serialize( name );
+  double bytes( std::filesystem::file_size( name ) );
+
+  s.run( "image/serialize", "byte", bytes, [&]() { machine.serialize( name ); } );
+  s.run( "image/deserialize", "byte", bytes, [&]()
+	 {
+	   machine.deserialize( name );
+	   sink = machine.program[1];
+	 } );
+  std::remove( name.c_str() );
+}
+
+// a source file of every statement form, labels and comments
+string
+bench_source( unsigned statements )
+{
+  static const char *const forms[] =
+    {
+      "push-l 12;", "pop-a 2000;", "add-r reg:5, reg:6;", "inc-x [stack:3];",
+      "rsh reg:5, 3; ! shift", "ouch2 'ab';", "j-e top;", "mul-r reg:7, reg:8;",
+      "dec-x reg:9;", "cmp-r reg:5, reg:6;"
+    };
+  std::stringstream text;
+  text << "top: halt;\n";
+  std::mt19937 random(48);
+  for( unsigned i=1; i<statements; ++i )
+    {
+      if( i%16==0 )
+	text << "l" << i << ": ";
+      text << forms[ random() % (sizeof forms/sizeof forms[0]) ] << "\n";
+    }
+  return text.str();
+}
+
+void
+assembly( bench_suite &s )
+{
+  if( !s.wanted("assembler/") ) return;
+  const unsigned statements( 4000 );
+  string text( bench_source( statements ) );
+  assembler a;
+  declare_builtins(a);
+  s.run( "assembler/statements", "statement", statements, [&]()
+	 {
+	   object_file o;
+	   a.assemble( o, text );
+	   sink = o.code.size();
+	 } );
+}
+
+// matching words against the automaton of a word list, built and
+// as compiled to a table
+void
+automata( bench_suite &s )
+{
+  if( !s.wanted("dfa/") ) return;
+  std::mt19937 random(48);
+  auto word = [&]()
+    {
+      string w( 3 + random()%8, ' ' );
+      for( char &c : w ) c = 'a' + random()%26;
+      return w;
+    };
+  vector<string> words;
+  for( unsigned i=0; i<20000; ++i ) words.push_back( word() );
+  std::sort( words.begin(), words.end() );
+  words.erase( std::unique( words.begin(), words.end() ), words.end() );
+
+  dfa d;
+  for( string const &w : words ) d.accept_sorted(w);
+  d.finish_sorted();
+  compiled_dfa c(d);
+
+  // half the queries are in the list
+  vector<string> queries;
+  double bytes(0);
+  for( unsigned i=0; i<2000; ++i )
+    {
+      queries.push_back( i%2 ? words[ random()%words.size() ] : word() );
+      bytes += queries.back().size();
+    }
+
+  s.run( "dfa/p_accepts", "byte", bytes, [&]()
+	 {
+	   int n(0);
+	   for( string const &q : queries ) n += d.p_accepts(q);
+	   sink = n;
+	 } );
+  s.run( "dfa/compiled-p_accepts", "byte", bytes, [&]()
+	 {
+	   int n(0);
+	   for( string const &q : queries ) n += c.p_accepts(q);
+	   sink = n;
+	 } );
+}
+
+// h64k-bench [-n samples] [-t ms] [-j results.json] [-c baseline.json] [filter]
+int
+main( int argc, char **argv )
+{
+  try
+    {
+      bench_suite s;
+      string json, baseline;
+      for( int i=1; i<argc; ++i )
+	{
+	  string arg( argv[i] );
+	  if( arg=="-n" && i+1<argc )
+	    s.samples = std::max( 1, std::atoi( argv[++i] ) );
+	  else if( arg=="-t" && i+1<argc )
+	    s.sample_ms = std::atof( argv[++i] );
+	  else if( arg=="-j" && i+1<argc )
+	    json = argv[++i];
+	  else if( arg=="-c" && i+1<argc )
+	    baseline = argv[++i];
+	  else if( arg[0]=='-' )
+	    {
+	      std::cout << "usage: h64k-bench [-n samples] [-t ms] [-j results.json] [-c baseline.json] [filter]\n";
+	      return 1;
+	    }
+	  else
+	    s.only = arg;
+	}
+
+      dispatch(s);
+      lookups(s);
+      lambdas(s);
+      images(s);
+      assembly(s);
+      automata(s);
+      std::cerr << "\n";
+
+      s.report_text( std::cout );
+      if( !json.empty() )
+	{
+	  std::ofstream out( json );
+	  s.report_json( out, BENCH_VERSION );
+	  if( !out )
+	    throw runtime_error("Could not write " + json + ".");
+	}
+      if( !baseline.empty() )
+	{
+	  std::ifstream in( baseline );
+	  if( !in )
+	    throw runtime_error("Could not open " + baseline + ".");
+	  std::cout << "\n";
+	  s.compare( std::cout, bench_suite::read_json( in ) );
+	}
+    }
+  catch( runtime_error &e )
+    {
+      std::cout << e.what() << "\n";
+      return 1;
+    }
+  return 0;
+}
@@ -0,0 +1,169 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::function;
+using std::ostream;
+using std::istream;
+
+// the harness behind h64k-bench. A benchmark is a function that does
+// a known number of operations each time it is called. The harness
+// doubles the calls in a sample until a sample takes long enough to
+// time, takes that many samples, and keeps the time per operation of
+// each; results are percentiles over the samples.
+class bench_suite
+{
+ public:
+  typedef struct
+  {
+    string name;
+    // what is counted: "op", "byte", "statement"
+    string unit;
+    // calls per sample
+    unsigned batch;
+    // nanoseconds per operation, one for each sample, in order
+    vector<double> ns;
+  } result;
+
+  vector<result> results;
+
+  // samples per benchmark, and how long one should at least take
+  unsigned samples;
+  double sample_ms;
+  // only benchmarks whose names contain this are run
+  string only;
+
+  bench_suite()
+    : samples(25), sample_ms(2), only()
+  {}
+
+  bool
+    wanted( string const &name ) const
+  {
+    return name.find( only )!=string::npos;
+  }
+
+  // time f, which does per_call units of work each call
+  void
+    run( string const &name, string const &unit, double per_call, function<void()> f )
+  {
+    if( !wanted(name) ) return;
+    typedef std::chrono::steady_clock clock;
+    auto time = [&]( unsigned calls )
+      {
+	auto start( clock::now() );
+	for( unsigned i=0; i<calls; ++i ) f();
+	return std::chrono::duration<double,std::nano>( clock::now() - start ).count();
+      };
+
+    unsigned batch(1);
+    while( time(batch) < sample_ms*1e6 && batch < (1u<<30) )
+      batch *= 2;
+
+    result r{ name, unit, batch, {} };
+    for( unsigned s=0; s<samples; ++s )
+      r.ns.push_back( time(batch) / (batch*per_call) );
+    std::sort( r.ns.begin(), r.ns.end() );
+    results.push_back(r);
+    std::cerr << "." << std::flush;
+  }
+
+  // the nearest-rank percentile p of r's samples
+  static double
+    percentile( result const &r, double p )
+  {
+    std::size_t rank( std::ceil( p/100 * r.ns.size() ) );
+    return r.ns[ std::min( std::max<std::size_t>( rank, 1 ), r.ns.size() ) - 1 ];
+  }
+
+  // units a second at the median
+  static double
+    rate( result const &r )
+  {
+    return 1e9 / percentile( r, 50 );
+  }
+
+  void
+    report_text( ostream &out ) const
+  {
+    out << std::left << std::setw(28) << "benchmark" << std::right
+	<< std::setw(10) << "p10" << std::setw(10) << "p50"
+	<< std::setw(10) << "p90" << std::setw(10) << "p99"
+	<< "  ns/unit" << std::setw(16) << "rate" << "\n";
+    for( result const &r : results )
+      {
+	out << std::left << std::setw(28) << r.name << std::right << std::fixed << std::setprecision(2);
+	for( double p : { 10, 50, 90, 99 } )
+	  out << std::setw(10) << percentile( r, p );
+	out << "  " << std::setw(7) << std::left << r.unit << std::right
+	    << std::setw(16) << std::setprecision(0) << rate(r) << "/s\n";
+      }
+  }
+
+  // one JSON object a line: the run first, then every benchmark
+  void
+    report_json( ostream &out, string const &version ) const
+  {
+    out << "{\"suite\":\"h64k-bench\",\"version\":\"" << version
+	<< "\",\"samples\":" << samples << "}\n";
+    for( result const &r : results )
+      {
+	out << std::setprecision(6) << std::defaultfloat
+	    << "{\"name\":\"" << r.name << "\",\"unit\":\"" << r.unit
+	    << "\",\"batch\":" << r.batch << ",\"samples\":" << r.ns.size()
+	    << ",\"min_ns\":" << r.ns.front();
+	for( int p : { 10, 50, 90, 99 } )
+	  out << ",\"p" << p << "_ns\":" << percentile( r, p );
+	out << ",\"max_ns\":" << r.ns.back()
+	    << ",\"per_second\":" << rate(r) << "}\n";
+      }
+  }
+
+  // the median of each benchmark in JSON written by report_json
+  static map<string,double>
+    read_json( istream &in )
+  {
+    map<string,double> medians;
+    string line;
+    while( std::getline( in, line ) )
+      {
+	std::size_t n( line.find("\"name\":\"") ), m( line.find("\"p50_ns\":") );
+	if( n==string::npos || m==string::npos ) continue;
+	n += 8;
+	medians[ line.substr( n, line.find( '"', n ) - n ) ] = std::stod( line.substr( m+9 ) );
+      }
+    return medians;
+  }
+
+  // how the medians moved since a baseline; positive is slower
+  void
+    compare( ostream &out, map<string,double> const &baseline ) const
+  {
+    out << std::left << std::setw(28) << "benchmark" << std::right
+	<< std::setw(12) << "before" << std::setw(12) << "after" << std::setw(10) << "change\n";
+    for( result const &r : results )
+      {
+	auto b = baseline.find( r.name );
+	if( b==baseline.end() ) continue;
+	double now( percentile( r, 50 ) );
+	out << std::left << std::setw(28) << r.name << std::right << std::fixed << std::setprecision(2)
+	    << std::setw(12) << b->second << std::setw(12) << now
+	    << std::setw(9) << std::showpos << 100*(now - b->second)/b->second << "%"
+	    << std::noshowpos << "\n";
+      }
+  }
+};
+
+#endif
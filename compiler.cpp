@@ -1,20 +1,98 @@
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <cstdlib>
 
-
+#include "vm.h"
+#include "vm-default.h"
+#include "symbols.h"
 #include "parser.h"
 #include "language.h"
 #include "ast.h"
 
-using std::istream;
+using std::string;
+using std::vector;
 
+string
+image_name( string const &fn )
+{
+  std::size_t dot( fn.rfind('.') );
+  std::size_t slash( fn.rfind('/') );
+  if( dot==string::npos || (slash!=string::npos && dot<slash) )
+    return fn + ".b64";
+  return fn.substr(0,dot) + ".b64";
+}
+
+// compile a program into an image for a machine of type M
+template<class M>
+void
+write_image( string const &text, string const &out, bool small )
+{
+  symbol_table symbols;
+  parser p( symbols );
+  ast tree( p.parse( text ) );
+
+  M machine( create_default_vm<M>() );
+  int base( machine.W() );
+  vector<int> code( language( tree, base ).compile( small, machine.extensions.size() ) );
+  if( base + code.size() > M::size )
+    throw runtime_error("Program does not fit in the program segment.");
+  for( unsigned i=0; i<code.size(); ++i )
+    machine.program[base+i] = code[i];
+  machine.W() = (base + code.size()) & M::mask;
+  machine.IP() = base;
+  machine.SP() = M::size-1;
+  machine.serialize( out );
+}
+
+// h64k-c [-Os] [-m words] [-o image.b64] file.h64
 int
-main(int argc, char **argv )
+main( int argc, char **argv )
 {
-  parser<expr>  p;
+  try
+    {
+      unsigned words( VM_SIZE );
+      bool small(false);
+      string out, in;
+      for( int i=1; i<argc; ++i )
+	{
+	  string arg( argv[i] );
+	  if( arg=="-o" && i+1<argc )
+	    out = argv[++i];
+	  else if( arg=="-Os" )
+	    small = true;
+	  else if( arg=="-m" && i+1<argc )
+	    words = std::strtoul( argv[++i], nullptr, 0 );
+	  else if( in.empty() )
+	    in = arg;
+	  else
+	    throw runtime_error("One source file at a time.");
+	}
+      if( in.empty() )
+	{
+	  std::cout << "usage: h64k-c [-Os] [-m words] [-o image.b64] file.h64\n";
+	  return 1;
+	}
+      if( out.empty() )
+	out = image_name( in );
+
+      std::ifstream fin( in, std::ios::binary );
+      if( !fin )
+	throw runtime_error("Could not open " + in + ".");
+      string text( (std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>() );
 
-  if( argc > 1 ) {
-    
-  }
-  
+      with_segment_size( words, [&]( auto m )
+	{
+	  write_image<typename decltype(m)::type>( text, out, small );
+	} );
+    }
+  catch( runtime_error &e )
+    {
+      std::cout << e.what() << "\n";
+      std::cout << "Compilation aborted.\n";
+      return 1;
+    }
   return 0;
 }
@@ -0,0 +1,229 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+#include "vm.h"
+#include "vm-default.h"
+#include "paging.h"
+#include "assembler.h"
+#include "symbols.h"
+#include "parser.h"
+#include "language.h"
+
+using std::string;
+using std::vector;
+
+// what one run of a program on one engine did
+typedef struct
+{
+  string output;
+  unsigned long retired;
+  double seconds;
+} outcome;
+
+// how a program's text becomes code: a .s64 is assembled, a .h64
+// compiled as h64k-c does, plainly and with -Os
+typedef enum
+  {
+    assembled, compiled, compiled_small
+  } build;
+
+// put the code text makes into machine, and point IP at it
+template<class M>
+void
+load( M &machine, string const &text, build how )
+{
+  if( how==assembled )
+    {
+      assembler a;
+      declare_builtins(a);
+      a.assemble( machine, text );
+      machine.IP() = 0;
+      return;
+    }
+  symbol_table symbols;
+  parser p( symbols );
+  ast tree( p.parse( text ) );
+  int base( machine.W() );
+  vector<int> code( language( tree, base ).compile( how==compiled_small, machine.extensions.size() ) );
+  if( base + code.size() > M::size )
+    throw runtime_error("Program does not fit in the program segment.");
+  for( unsigned i=0; i<code.size(); ++i )
+    machine.program[base+i] = code[i];
+  machine.W() = (base + code.size()) & M::mask;
+  machine.IP() = base;
+}
+
+// build text into a fresh machine of type M and run it to halt,
+// with what it prints kept rather than shown
+template<class M>
+outcome
+run_on( string const &text, build how )
+{
+  M machine( create_default_vm<M>() );
+  load( machine, text, how );
+  machine.SP() = M::size-1;
+
+  std::stringstream out;
+  std::streambuf *shown( std::cout.rdbuf( out.rdbuf() ) );
+  auto start( std::chrono::steady_clock::now() );
+  try
+    {
+      machine *= vm::assemble(builtin_code("run"));
+    }
+  catch( ... )
+    {
+      std::cout.rdbuf( shown );
+      throw;
+    }
+  std::chrono::duration<double> took( std::chrono::steady_clock::now() - start );
+  std::cout.rdbuf( shown );
+  return outcome{ out.str(), machine.retired, took.count() };
+}
+
+// every way there is to run a program: the machine with its segments
+// in memory, and the same machine with paged segments
+typedef struct
+{
+  const char *name;
+  outcome (*run)( string const &text, build how );
+} engine;
+
+const engine engines[] =
+  {
+    { "flat",  run_on<vm> },
+    { "paged", run_on< basic_vm< VM_SIZE, paged_segment<VM_SIZE> > > },
+  };
+
+string
+read_file( string const &name )
+{
+  std::ifstream in( name, std::ios::binary );
+  if( !in )
+    throw runtime_error("Could not open " + name + ".");
+  return string( (std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>() );
+}
+
+// the golden output of program.s64 or program.h64 is in program.out
+string
+golden_name( string const &program )
+{
+  std::size_t dot( program.rfind('.') );
+  return program.substr( 0, dot ) + ".out";
+}
+
+// the ways to build a program: a .h64 both ways h64k-c compiles it,
+// to the same output
+vector<build>
+builds_of( string const &program )
+{
+  std::size_t dot( program.rfind('.') );
+  if( dot!=string::npos && program.substr(dot)==".h64" )
+    return { compiled, compiled_small };
+  return { assembled };
+}
+
+// h64k-corpus [-n runs] [-g] [-j results.json] program.s64|program.h64 ...
+//
+// runs each program on every engine, best of n runs, and checks what
+// it prints against its golden output; -g writes the golden outputs
+// instead. A .h64 is compiled, and run once plainly compiled and once
+// with -Os. Exits 1 if any output differs, or if the engines disagree
+// on how many instructions a build of a program takes.
+int
+main( int argc, char **argv )
+{
+  try
+    {
+      unsigned runs(3);
+      bool golden(false);
+      string json;
+      vector<string> programs;
+      for( int i=1; i<argc; ++i )
+	{
+	  string arg( argv[i] );
+	  if( arg=="-n" && i+1<argc )
+	    runs = std::max( 1, std::atoi( argv[++i] ) );
+	  else if( arg=="-g" )
+	    golden = true;
+	  else if( arg=="-j" && i+1<argc )
+	    json = argv[++i];
+	  else
+	    programs.push_back( arg );
+	}
+      if( programs.empty() )
+	{
+	  std::cout << "usage: h64k-corpus [-n runs] [-g] [-j results.json] program.s64|program.h64 ...\n";
+	  return 1;
+	}
+
+      std::ofstream results;
+      if( !json.empty() )
+	{
+	  results.open( json );
+	  if( !results )
+	    throw runtime_error("Could not write " + json + ".");
+	}
+
+      bool failed(false);
+      std::cout << std::left << std::setw(24) << "program" << std::setw(8) << "engine" << std::right
+		<< std::setw(14) << "retired" << std::setw(12) << "seconds" << std::setw(10) << "MIPS" << "\n";
+      for( string const &p : programs )
+	{
+	  string text( read_file(p) );
+	  vector<build> builds( builds_of(p) );
+	  for( build how : builds )
+	    {
+	      string name( how==compiled_small ? p + " -Os" : p );
+	      unsigned long retired(0);
+	      for( engine const &e : engines )
+		{
+		  outcome best( e.run(text,how) );
+		  for( unsigned r=1; r<runs; ++r )
+		    {
+		      outcome o( e.run(text,how) );
+		      if( o.seconds < best.seconds ) best = o;
+		    }
+
+		  string verdict;
+		  if( golden && how==builds.front() && &e==engines )
+		    {
+		      std::ofstream g( golden_name(p), std::ios::binary );
+		      g << best.output;
+		      verdict = "written";
+		    }
+		  else if( best.output != read_file( golden_name(p) ) )
+		    verdict = "WRONG OUTPUT";
+		  if( retired && best.retired != retired )
+		    verdict = "RETIRED DIFFERS";
+		  retired = best.retired;
+		  bool ok( verdict.empty() || verdict=="written" );
+		  failed = failed || !ok;
+
+		  double mips( best.retired / best.seconds / 1e6 );
+		  std::cout << std::left << std::setw(24) << name << std::setw(8) << e.name << std::right
+			    << std::setw(14) << best.retired << std::fixed
+			    << std::setw(12) << std::setprecision(4) << best.seconds
+			    << std::setw(10) << std::setprecision(1) << mips
+			    << "  " << verdict << "\n";
+		  if( results )
+		    results << "{\"program\":\"" << name << "\",\"engine\":\"" << e.name
+			    << "\",\"retired\":" << best.retired << ",\"seconds\":" << best.seconds
+			    << ",\"mips\":" << mips << ",\"ok\":" << (ok ? "true" : "false") << "}\n";
+		}
+	    }
+	}
+      return failed ? 1 : 0;
+    }
+  catch( runtime_error &e )
+    {
+      std::cout << e.what() << "\n";
+      return 1;
+    }
+}
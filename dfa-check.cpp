@@ -0,0 +1,165 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <random>
+#include <algorithm>
+#include <cstdlib>
+
+#include "dfa.h"
+
+using std::string;
+using std::vector;
+
+// the letters words are made of; few, so that prefixes and first
+// letters match often
+const string letters( "abcAB" );
+
+// a filter three ways: as word_filter, as the filter_fn combinators,
+// and as a naive matcher that works each part out on the whole word
+typedef struct
+{
+  word_filter f;
+  filter_fn combined;
+  filter_fn naive;
+} filter_case;
+
+typedef std::mt19937 generator;
+
+string
+random_word( generator &random, unsigned longest )
+{
+  string w( random() % (longest+1), ' ' );
+  for( char &c : w ) c = letters[ random() % letters.size() ];
+  return w;
+}
+
+// a random filter of at most depth levels of &, | and !
+filter_case
+random_filter( generator &random, unsigned depth )
+{
+  unsigned pick( random() % (depth ? 6 : 3) );
+  switch( pick )
+    {
+    case 0:
+      {
+	string p( random_word( random, 2 ) );
+	return filter_case{ word_filter::starts_with(p), begins_with(p),
+	    [p]( string const &w ) { return w.compare( 0, p.size(), p )==0; } };
+      }
+    case 1:
+    case 2:
+      {
+	std::set<char> in;
+	for( char c : letters )
+	  if( random() % 2 ) in.insert(c);
+	auto is = [in]( unsigned char c ) { return in.count(c) > 0; };
+	if( pick==1 )
+	  return filter_case{ word_filter::first_is(is),
+	      [is]( string const &w ) { return !w.empty() && is(w[0]); },
+	      [in]( string const &w ) { return w.size() > 0 && in.count(w[0]) > 0; } };
+	return filter_case{ word_filter::all_are(is),
+	    [is]( string const &w ) { return std::all_of( w.begin(), w.end(), is ); },
+	    [in]( string const &w )
+	    {
+	      for( char c : w )
+		if( !in.count(c) ) return false;
+	      return true;
+	    } };
+      }
+    case 3:
+      {
+	filter_case a( random_filter( random, depth-1 ) ), b( random_filter( random, depth-1 ) );
+	filter_fn x( a.naive ), y( b.naive );
+	return filter_case{ a.f & b.f, And( a.combined, b.combined ),
+	    [x,y]( string const &w ) { return x(w) && y(w); } };
+      }
+    case 4:
+      {
+	filter_case a( random_filter( random, depth-1 ) ), b( random_filter( random, depth-1 ) );
+	filter_fn x( a.naive ), y( b.naive );
+	return filter_case{ a.f | b.f, Or( a.combined, b.combined ),
+	    [x,y]( string const &w ) { return x(w) || y(w); } };
+      }
+    default:
+      {
+	filter_case a( random_filter( random, depth-1 ) );
+	filter_fn x( a.naive ), c( a.combined );
+	return filter_case{ !a.f, [c]( string const &w ) { return !c(w); },
+	    [x]( string const &w ) { return !x(w); } };
+      }
+    }
+}
+
+// h64k-dfa-check [-n filters] [-s seed]
+//
+// checks the filters of dfa.h against a naive matcher: for random
+// filters, that word_filter and the And/Or combinators agree with it
+// on random words, and that the product of a word list's dfa with
+// the filter, as built, minimized and compiled, accepts just the
+// words of the list the matcher passes. Exits 1 on any difference.
+int
+main( int argc, char **argv )
+{
+  unsigned filters(500), seed(41);
+  for( int i=1; i<argc; ++i )
+    {
+      string arg( argv[i] );
+      if( arg=="-n" && i+1<argc )
+	filters = std::atoi( argv[++i] );
+      else if( arg=="-s" && i+1<argc )
+	seed = std::atoi( argv[++i] );
+      else
+	{
+	  std::cout << "usage: h64k-dfa-check [-n filters] [-s seed]\n";
+	  return 1;
+	}
+    }
+
+  generator random( seed );
+  vector<string> words;
+  for( unsigned i=0; i<300; ++i ) words.push_back( random_word( random, 5 ) );
+  std::sort( words.begin(), words.end() );
+  words.erase( std::unique( words.begin(), words.end() ), words.end() );
+  std::set<string> listed( words.begin(), words.end() );
+
+  dfa d;
+  for( string const &w : words ) d.accept_sorted(w);
+  d.finish_sorted();
+
+  // every listed word, and as many that mostly are not
+  vector<string> queries( words );
+  for( unsigned i=0; i<words.size(); ++i ) queries.push_back( random_word( random, 6 ) );
+
+  unsigned failures(0);
+  auto check = [&]( unsigned n, string const &what, string const &w, bool got, bool want )
+    {
+      if( got==want ) return;
+      if( ++failures <= 10 )
+	std::cout << "filter " << n << ": " << what << " says " << got
+		  << " for \"" << w << "\", expected " << want << "\n";
+    };
+
+  for( unsigned n=0; n<filters; ++n )
+    {
+      filter_case c( random_filter( random, 3 ) );
+      dfa product( d.filtered( c.f ) );
+      dfa smallest( product );
+      smallest.minimize();
+      compiled_dfa compiled( product );
+      for( string const &w : queries )
+	{
+	  bool want( c.naive(w) );
+	  check( n, "word_filter", w, c.f(w), want );
+	  check( n, "filter_fn", w, c.combined(w), want );
+	  want = want && listed.count(w);
+	  check( n, "filtered", w, product.p_accepts(w), want );
+	  check( n, "minimized", w, smallest.p_accepts(w), want );
+	  check( n, "compiled", w, compiled.p_accepts(w), want );
+	}
+    }
+
+  std::cout << filters << " filters over " << queries.size() << " words: "
+	    << (failures ? std::to_string(failures) + " failures" : string("ok")) << "\n";
+  return failures ? 1 : 0;
+}
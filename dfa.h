@@ -1,37 +1,70 @@
+#ifndef DFA_H
+#define DFA_H
+
 #include <iostream>
 #include <functional>
 #include <stdexcept>
-#include <gmpxx.h>
 #include <string>
 #include <fstream>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <cstdlib>
 #include <ctime>
 #include <cctype>
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <thread>
+#include <string_view>
+#include <bitset>
+#include <memory>
+#include <tuple>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using std::function;
 using std::string;
 using std::runtime_error;
 using std::set;
 using std::map;
+using std::unordered_map;
 using std::ifstream;
 using std::ofstream;
 using std::ostream;
 using std::rand;
 using std::time;
 using std::islower;
+using std::vector;
+using std::string_view;
+
+class word_filter;
 
 class dfa { 
 public: 
   typedef unsigned long long state;
 private:
   state new_state_counter;
+
+  // for accept_sorted: the last word added, the states along it and
+  // the states known to be minimal, by signature; and whether
+  // finish_sorted() has been called
+  string last_word;
+  bool finished;
+  vector<state> last_path;
+  unordered_map<string,state> registry;
+  // states and transitions made so far, as a trie would have them
+  size_t made_states;
+  size_t made_transitions;
 public:
   typedef char symbol;
   typedef function< state(state,symbol) > tfunc;
-  static const int START= 0;
-  static const int REJECT=-1;
+  static constexpr int START= 0;
+  static constexpr int REJECT=-1;
  
   state current;
   set<state> accept_states;
@@ -58,34 +91,84 @@ public:
     };
     // stores all transitions
     map<Index,state> t;
-    state operator() ( state s, symbol c ) {
-      if( t.count(Index(s,c)) > 0 ) {
-	return t[Index(s,c)];
-      } else {
-	return dfa::REJECT;
-      }
+    state operator() ( state s, symbol c ) const {
+      auto i = t.find(Index(s,c));
+      return i==t.end() ? state(dfa::REJECT) : i->second;
     }
     // define a transition from s to p via symbol c
     void augment( state s, symbol c, state p ) {
       Index i(s,c);
       t[i] = p;
     }
+    // the range of state s's transitions
+    map<Index,state>::iterator first_of_state( state s ) {
+      return t.lower_bound( Index( s, std::numeric_limits<symbol>::min() ) );
+    }
+    map<Index,state>::iterator end_of_state( state s ) {
+      auto i = first_of_state(s);
+      while( i != t.end() && i->first.s==s ) {
+	++i;
+      }
+      return i;
+    }
   } transition;
 
   dfa( ) {
     current = START;
     
     new_state_counter = 1;
+    last_path.push_back( START );
+    made_states = 1;
+    made_transitions = 0;
+    finished = false;
+  }
+
+  typedef struct {
+    size_t states;
+    size_t transitions;
+  } counts;
+
+  // states reachable from the start, and their transitions
+  counts count() const {
+    set<state> seen;
+    vector<state> todo( 1, state(START) );
+    seen.insert( START );
+    counts n = { 0, 0 };
+    while( !todo.empty() ) {
+      state s = todo.back();
+      todo.pop_back();
+      ++n.states;
+      for( auto it = first_of(s); it != transition.t.end() && it->first.s==s; ++it ) {
+	++n.transitions;
+	if( seen.insert( it->second ).second ) {
+	  todo.push_back( it->second );
+	}
+      }
+    }
+    return n;
   }
 
   
+  // whether this dfa accepts string s, without touching current,
+  // so that any number of threads can match at once
+  bool accepts( string const &s ) const {
+    state at = START;
+    for( char c : s ) {
+      at = transition( at, c );
+      if( at==state(REJECT) ) {
+	return false;
+      }
+    }
+    return accept_states.count( at )>0;
+  }
+
   // determine whether this dfa accepts string s                          .
   bool p_accepts( string const &s ) {
     current = START;
     
     for( char c : s ) {
       current = transition( current, c );
-      if( current==REJECT ) {
+      if( current==state(REJECT) ) {
 	return false;
       }
     }
@@ -95,11 +178,11 @@ private:
   // modify this DFA to define a transition to a new or existing state from
   // the current state
   void accept( char c ) {
-    if( current==REJECT ) {
+    if( current==state(REJECT) ) {
       throw runtime_error("Cannot transition to acceptance from rejection. :(");
     } else {
       state nextp = transition(current,c);
-      if( nextp==REJECT ) {
+      if( nextp==state(REJECT) ) {
 	// create a new state, update counter
 	state old_state = current;
 	current = new_state_counter++;
@@ -115,6 +198,14 @@ private:
 public:
   state size () { return new_state_counter; }
 
+  // a state no transition leads to yet, for building by hand
+  state add_state() { return new_state_counter++; }
+
+  // the first of state s's transitions
+  map<CFunc::Index,state>::const_iterator first_of( state s ) const {
+    return transition.t.lower_bound( CFunc::Index( s, std::numeric_limits<symbol>::min() ) );
+  }
+
 
   // modify the DFA's transition function
   // to accept string s, starting from the initial state
@@ -125,16 +216,775 @@ public:
     }
     accept_states.insert(current);
   }
+
+private:
+  // what makes a state equivalent to another with the same children
+  string signature( state s ) const {
+    string sig( 1, accept_states.count(s) ? 'a' : 'r' );
+    for( auto it = first_of(s); it != transition.t.end() && it->first.s==s; ++it ) {
+      sig += it->first.c;
+      sig.append( reinterpret_cast<const char*>( &it->second ), sizeof(state) );
+    }
+    return sig;
+  }
+
+  // the states below depth on the last word's path are finished:
+  // swap each for an equivalent registered state or register it
+  void replace_or_register( size_t depth ) {
+    for( size_t i = last_path.size()-1; i > depth; --i ) {
+      state child = last_path[i];
+      auto r = registry.emplace( signature(child), child );
+      if( !r.second ) {
+	transition.augment( last_path[i-1], last_word[i-1], r.first->second );
+	transition.t.erase( transition.first_of_state(child), transition.end_of_state(child) );
+	accept_states.erase( child );
+      }
+    }
+    last_path.resize( depth+1 );
+  }
+
+public:
+  // accept s, building the minimal automaton directly. Words must
+  // come in sorted order, and finish_sorted() must be called after
+  // the last one. Don't mix this with accept( string ).
+  void accept_sorted( string const &s ) {
+    if( finished ) {
+      throw runtime_error("Words cannot be added after finish_sorted().");
+    }
+    if( s < last_word ) {
+      throw runtime_error("Words must be added in sorted order.");
+    }
+    size_t common = 0;
+    while( common < s.size() && common < last_word.size() && s[common]==last_word[common] ) {
+      ++common;
+    }
+    replace_or_register( common );
+
+    for( size_t i = common; i < s.size(); ++i ) {
+      state fresh = new_state_counter++;
+      transition.augment( last_path.back(), s[i], fresh );
+      last_path.push_back( fresh );
+      ++made_states;
+      ++made_transitions;
+    }
+    accept_states.insert( last_path.back() );
+    last_word = s;
+  }
+
+  // minimize what is left of the last word. Says how big a trie of
+  // the same words would have been, and how big the automaton is.
+  std::pair<counts,counts> finish_sorted() {
+    replace_or_register( 0 );
+    registry.clear();
+    last_word.clear();
+    finished = true;
+    counts trie = { made_states, made_transitions };
+    return std::make_pair( trie, count() );
+  }
+
+  // merge equivalent states, however the automaton was built. This
+  // is Hopcroft's refinement in Valmari's form for partial
+  // transition functions, so missing transitions cost nothing.
+  // States are renumbered from START; the counts are from before
+  // and after.
+  std::pair<counts,counts> minimize();
+
+  // the words this dfa accepts that f passes, as one automaton: the
+  // product of this dfa with every part of f, so a word is checked
+  // in a single pass however many parts f has. Product states where
+  // f can no longer pass are left out.
+  dfa filtered( word_filter const &f ) const;
+};
+
+
+inline std::pair<dfa::counts,dfa::counts> dfa::minimize() {
+  counts before = count();
+
+  // number the reachable states and list the transitions as
+  // tail, label, head
+  map<state,int> id;
+  vector<state> order( 1, state(START) );
+  id[START] = 0;
+  vector<int> T, L, H;
+  for( size_t i=0; i<order.size(); ++i ) {
+    for( auto it = first_of( order[i] ); it != transition.t.end() && it->first.s==order[i]; ++it ) {
+      auto k = id.emplace( it->second, order.size() );
+      if( k.second ) {
+	order.push_back( it->second );
+      }
+      T.push_back( i );
+      L.push_back( (unsigned char)it->first.c );
+      H.push_back( k.first->second );
+    }
+  }
+  int nn = order.size(), mm = T.size(), q0 = 0;
+
+  // W holds the sets touched since the last split, M how many of
+  // each set's elements are marked; marked elements are moved to
+  // the front of their set
+  vector<int> M( std::max(nn,mm)+1 ), W( std::max(nn,mm)+1 );
+  int w = 0;
+  struct partition {
+    int z;
+    vector<int> E, L, S, F, P;
+    vector<int> &M, &W;
+    int &w;
+    partition( int n, vector<int> &M, vector<int> &W, int &w )
+      : z( n>0 ), E(n), L(n), S(n), F(n+1), P(n+1), M(M), W(W), w(w) {
+      for( int i=0; i<n; ++i ) {
+	E[i] = L[i] = i;
+	S[i] = 0;
+      }
+      if( z ) {
+	F[0] = 0;
+	P[0] = n;
+      }
+    }
+    void mark( int e ) {
+      int s = S[e], i = L[e], j = F[s]+M[s];
+      E[i] = E[j]; L[E[i]] = i;
+      E[j] = e; L[e] = j;
+      if( !M[s]++ ) {
+	W[w++] = s;
+      }
+    }
+    void split() {
+      while( w ) {
+	int s = W[--w], j = F[s]+M[s];
+	if( j==P[s] ) {
+	  M[s] = 0;
+	  continue;
+	}
+	if( M[s] <= P[s]-j ) {
+	  F[z] = F[s]; P[z] = F[s] = j;
+	} else {
+	  P[z] = P[s]; F[z] = P[s] = j;
+	}
+	for( int i=F[z]; i<P[z]; ++i ) {
+	  S[E[i]] = z;
+	}
+	M[s] = M[z++] = 0;
+      }
+    }
+  };
+  partition B( nn, M, W, w );
+
+  // A lists the transitions of each state by K, from index F[q]
+  vector<int> A( mm ), AF( nn+1 );
+  auto make_adjacent = [&]( vector<int> const &K ) {
+    std::fill( AF.begin(), AF.end(), 0 );
+    for( int t=0; t<mm; ++t ) ++AF[K[t]];
+    for( int q=0; q<nn; ++q ) AF[q+1] += AF[q];
+    for( int t=mm; t--; ) A[--AF[K[t]]] = t;
+  };
+
+  // drop states that are unreachable, or cannot reach acceptance
+  int rr = 0;
+  auto reach = [&]( int q ) {
+    int i = B.L[q];
+    if( i >= rr ) {
+      B.E[i] = B.E[rr]; B.L[B.E[i]] = i;
+      B.E[rr] = q; B.L[q] = rr++;
+    }
+  };
+  auto rem_unreachable = [&]( vector<int> &K, vector<int> &G ) {
+    make_adjacent(K);
+    for( int i=0; i<rr; ++i ) {
+      for( int j=AF[B.E[i]]; j<AF[B.E[i]+1]; ++j ) {
+	reach( G[A[j]] );
+      }
+    }
+    int j = 0;
+    for( int t=0; t<mm; ++t ) {
+      if( B.L[K[t]] < rr ) {
+	H[j] = H[t]; L[j] = L[t]; T[j] = T[t]; ++j;
+      }
+    }
+    mm = j;
+    B.P[0] = rr;
+    rr = 0;
+  };
+
+  if( nn ) {
+    reach( q0 );
+    rem_unreachable( T, H );
+  }
+  for( int q=0; q<nn; ++q ) {
+    if( accept_states.count( order[q] ) && B.L[q] < B.P[0] ) {
+      reach( q );
+    }
+  }
+  int ff = rr;
+  if( nn ) {
+    rem_unreachable( H, T );
+  }
+
+  transition.t.clear();
+  accept_states.clear();
+  current = START;
+  last_path.assign( 1, state(START) );
+  if( ff==0 ) {
+    // nothing is accepted
+    new_state_counter = 1;
+    return std::make_pair( before, count() );
+  }
+
+  // finals and the rest, then split blocks by the labels that lead
+  // into them, and labels by the blocks they come from
+  M[0] = ff;
+  W[w++] = 0;
+  B.split();
+
+  partition C( mm, M, W, w );
+  if( mm ) {
+    std::sort( C.E.begin(), C.E.begin()+mm, [&]( int a, int b ) { return L[a] < L[b]; } );
+    C.z = M[0] = 0;
+    int a = L[C.E[0]];
+    for( int i=0; i<mm; ++i ) {
+      int t = C.E[i];
+      if( L[t] != a ) {
+	a = L[t];
+	C.P[C.z++] = i;
+	C.F[C.z] = i;
+	M[C.z] = 0;
+      }
+      C.S[t] = C.z;
+      C.L[t] = i;
+    }
+    C.P[C.z++] = mm;
+  }
+
+  make_adjacent( H );
+  int b = 1, c = 0;
+  while( c < C.z ) {
+    for( int i=C.F[c]; i<C.P[c]; ++i ) {
+      B.mark( T[C.E[i]] );
+    }
+    B.split();
+    ++c;
+    while( b < B.z ) {
+      for( int i=B.F[b]; i<B.P[b]; ++i ) {
+	for( int j=AF[B.E[i]]; j<AF[B.E[i]+1]; ++j ) {
+	  C.mark( A[j] );
+	}
+      }
+      C.split();
+      ++b;
+    }
+  }
+
+  // one state per block, the start's block first
+  int start_block = B.S[q0];
+  auto renumber = [&]( int blk ) -> state {
+    return blk==start_block ? 0 : blk < start_block ? blk+1 : blk;
+  };
+  for( int t=0; t<mm; ++t ) {
+    if( B.L[T[t]]==B.F[B.S[T[t]]] ) {
+      transition.augment( renumber( B.S[T[t]] ), symbol( L[t] ), renumber( B.S[H[t]] ) );
+    }
+  }
+  for( int blk=0; blk<B.z; ++blk ) {
+    if( B.F[blk] < ff ) {
+      accept_states.insert( renumber(blk) );
+    }
+  }
+  new_state_counter = B.z;
+  return std::make_pair( before, count() );
+}
+
+// a dfa frozen for matching. States are numbered densely with the
+// dead state, where every rejection ends up, first and the accepting
+// states last. Bytes that every state treats alike share a class,
+// and each row of the table holds one state's transitions by class.
+// State numbers are premultiplied by the number of classes, so a
+// step is a single table load once the byte's class is known; the
+// class map is 256 bytes and stays in cache.
+//
+// The table is never written after it is made, so copies share it.
+// It is either built here or mapped straight from a file that save()
+// wrote, in which case processes mapping the same file share one
+// copy in the page cache.
+class compiled_dfa {
+public:
+  typedef uint32_t index;
+
+  // the class of every byte
+  unsigned char alphabet[256];
+  unsigned classes;
+  index states;
+  // premultiplied start state
+  index start;
+  // premultiplied states from here on accept
+  index first_accept;
+  // states x classes, premultiplied targets
+  const index *next;
+
+  // a saved table: this header, then the table in the byte order of
+  // the machine that wrote it. Accepting states are the ones from
+  // first_accept on, so they need no map of their own.
+  typedef struct {
+    char magic[4];
+    // 1, as the writer stored it
+    uint32_t order;
+    uint32_t classes;
+    uint32_t states;
+    uint32_t start;
+    uint32_t first_accept;
+    unsigned char alphabet[256];
+  } file_header;
+
+private:
+  // keeps whatever next points into alive
+  std::shared_ptr<const void> storage;
+
+  compiled_dfa() {}
+
+public:
+  // numbering, if given, is told the premultiplied number of every
+  // reachable state of d
+  explicit compiled_dfa( dfa const &d, map<dfa::state,index> *numbering = nullptr ) {
+    typedef dfa::state state;
+    const state reject = dfa::REJECT;
+
+    // reachable states, breadth first from the start
+    unordered_map<state,index> number;
+    vector<state> order;
+    order.push_back( dfa::START );
+    number[dfa::START] = 0;
+    for( size_t i=0; i<order.size(); ++i ) {
+      for( auto it = d.first_of( order[i] ); it != d.transition.t.end() && it->first.s==order[i]; ++it ) {
+	if( it->second != reject && number.emplace( it->second, order.size() ).second ) {
+	  order.push_back( it->second );
+	}
+      }
+    }
+
+    // split bytes into classes: two bytes share one only if every
+    // state sends them to the same place
+    unsigned cls[256] = {};
+    unsigned next_class = 1;
+    // a state's transitions as (class, target, byte), sorted so that
+    // bytes that stay together are next to each other
+    vector< std::tuple<unsigned,state,unsigned char> > split;
+    for( state s : order ) {
+      split.clear();
+      for( auto it = d.first_of( s ); it != d.transition.t.end() && it->first.s==s; ++it ) {
+	unsigned char c = it->first.c;
+	split.emplace_back( cls[c], it->second, c );
+      }
+      std::sort( split.begin(), split.end() );
+      for( size_t j=0; j<split.size(); ++j ) {
+	if( j==0 || std::get<0>(split[j]) != std::get<0>(split[j-1]) || std::get<1>(split[j]) != std::get<1>(split[j-1]) ) {
+	  ++next_class;
+	}
+	cls[ std::get<2>(split[j]) ] = next_class-1;
+      }
+    }
+    map<unsigned,unsigned char> dense;
+    for( int c=0; c<256; ++c ) {
+      auto k = dense.emplace( cls[c], dense.size() );
+      alphabet[c] = k.first->second;
+    }
+    classes = dense.size();
+
+    // dead state 0, then the others, then the accepting ones
+    vector<index> renumber( order.size() );
+    index n = 1;
+    for( int accepting=0; accepting<2; ++accepting ) {
+      if( accepting ) {
+	first_accept = n*classes;
+      }
+      for( size_t i=0; i<order.size(); ++i ) {
+	if( (d.accept_states.count( order[i] )>0) == bool(accepting) ) {
+	  renumber[i] = n++;
+	}
+      }
+    }
+    states = n;
+    start = renumber[0]*classes;
+    if( numbering ) {
+      for( size_t i=0; i<order.size(); ++i ) {
+	(*numbering)[ order[i] ] = renumber[i]*classes;
+      }
+    }
+
+    auto table = std::make_shared< vector<index> >( size_t(states)*classes, 0 );
+    next = table->data();
+    storage = table;
+    for( size_t i=0; i<order.size(); ++i ) {
+      index *row = &(*table)[ size_t(renumber[i])*classes ];
+      for( auto it = d.first_of( order[i] ); it != d.transition.t.end() && it->first.s==order[i]; ++it ) {
+	if( it->second != reject ) {
+	  row[ alphabet[ (unsigned char)it->first.c ] ] = renumber[ number[it->second] ]*classes;
+	}
+      }
+    }
+  }
+
+  // write the table for map_file
+  void save( string const &name ) const {
+    file_header h;
+    std::memcpy( h.magic, "HDFA", 4 );
+    h.order = 1;
+    h.classes = classes;
+    h.states = states;
+    h.start = start;
+    h.first_accept = first_accept;
+    std::memcpy( h.alphabet, alphabet, sizeof alphabet );
+    ofstream out( name, std::ios::binary );
+    out.write( reinterpret_cast<const char*>( &h ), sizeof h );
+    out.write( reinterpret_cast<const char*>( next ), size_t(states)*classes*sizeof(index) );
+    if( !out ) {
+      throw runtime_error("Could not write " + name + ".");
+    }
+  }
+
+  // use a table save() wrote in place. Only the header is checked:
+  // the size it gives, the start state, and that every byte class is
+  // below the number of classes. The table is trusted, so that
+  // nothing reads it before matching; a mapping can change under
+  // its reader anyway, so callers that do not trust the file must
+  // bound the targets they step to.
+  static compiled_dfa map_file( string const &name ) {
+    int fd = open( name.c_str(), O_RDONLY );
+    if( fd < 0 ) {
+      throw runtime_error("Could not open " + name + ".");
+    }
+    struct stat st;
+    if( fstat( fd, &st ) != 0 || size_t(st.st_size) < sizeof(file_header) ) {
+      close( fd );
+      throw runtime_error(name + " is not a saved dfa.");
+    }
+    size_t bytes = st.st_size;
+    void *at = mmap( nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( at==MAP_FAILED ) {
+      throw runtime_error("Could not map " + name + ".");
+    }
+    std::shared_ptr<const void> mapping( at, [bytes]( const void *p ) { munmap( const_cast<void*>(p), bytes ); } );
+
+    // checked in a copy, which cannot change after it is checked
+    file_header h;
+    std::memcpy( &h, at, sizeof h );
+    if( std::memcmp( h.magic, "HDFA", 4 ) != 0 ) {
+      throw runtime_error(name + " is not a saved dfa.");
+    }
+    if( h.order != 1 ) {
+      throw runtime_error(name + " was saved on a machine of the other byte order.");
+    }
+    if( h.classes==0 || h.classes > 256 || h.states==0
+	|| uint64_t(h.states)*h.classes != (bytes - sizeof h)/sizeof(index)
+	|| (bytes - sizeof h) % sizeof(index) != 0
+	|| uint64_t(h.states)*h.classes > std::numeric_limits<index>::max()
+	|| h.start >= h.states*h.classes || h.start % h.classes != 0
+	|| h.first_accept > h.states*h.classes ) {
+      throw runtime_error(name + " is a damaged saved dfa.");
+    }
+    for( int c=0; c<256; ++c ) {
+      if( h.alphabet[c] >= h.classes ) {
+	throw runtime_error(name + " is a damaged saved dfa.");
+      }
+    }
+
+    compiled_dfa c;
+    std::memcpy( c.alphabet, h.alphabet, sizeof c.alphabet );
+    c.classes = h.classes;
+    c.states = h.states;
+    c.start = h.start;
+    c.first_accept = h.first_accept;
+    c.next = reinterpret_cast<const index*>( static_cast<const char*>( at ) + sizeof h );
+    c.storage = mapping;
+    return c;
+  }
+
+  bool p_accepts( string_view w ) const {
+    index s = start;
+    for( unsigned char c : w ) {
+      s = next[ s + alphabet[c] ];
+    }
+    return s >= first_accept;
+  }
+
+  // one bit per word, set if the word is accepted: bit i%64 of
+  // element i/64
+  typedef vector<uint64_t> bitmap;
+
+  // match a batch of words, splitting it across threads
+  bitmap accepts( vector<string> const &words,
+		  unsigned threads = std::thread::hardware_concurrency() ) const {
+    return accepts_each( words.size(), threads,
+			 [&]( size_t i ) { return string_view( words[i] ); } );
+  }
+
+  // match the words of one buffer: word i runs from offsets[i] to
+  // offsets[i+1], so there is one word fewer than offsets
+  bitmap accepts( const char *text, vector<size_t> const &offsets,
+		  unsigned threads = std::thread::hardware_concurrency() ) const {
+    return accepts_each( offsets.empty() ? 0 : offsets.size()-1, threads,
+			 [&]( size_t i ) { return string_view( text+offsets[i], offsets[i+1]-offsets[i] ); } );
+  }
+
+private:
+  static const size_t lanes = 8;
+  // batches smaller than this aren't worth a thread
+  static const size_t per_thread = 1<<14;
+
+  // match words first to last, lanes at a time, so that the table
+  // loads of one word overlap those of the others
+  template<class Words>
+  void match_range( Words const &word, size_t first, size_t last, uint64_t *bits ) const {
+    const index *table = next;
+    size_t i = first;
+    for( ; i + lanes <= last; i += lanes ) {
+      const unsigned char *p[lanes];
+      size_t n[lanes];
+      index s[lanes];
+      size_t shortest = SIZE_MAX;
+      for( size_t k=0; k<lanes; ++k ) {
+	string_view w = word(i+k);
+	p[k] = reinterpret_cast<const unsigned char*>( w.data() );
+	n[k] = w.size();
+	s[k] = start;
+	shortest = std::min( shortest, n[k] );
+      }
+      for( size_t j=0; j<shortest; ++j ) {
+	for( size_t k=0; k<lanes; ++k ) {
+	  s[k] = table[ s[k] + alphabet[ p[k][j] ] ];
+	}
+      }
+      for( size_t k=0; k<lanes; ++k ) {
+	for( size_t j=shortest; j<n[k]; ++j ) {
+	  s[k] = table[ s[k] + alphabet[ p[k][j] ] ];
+	}
+	if( s[k] >= first_accept ) {
+	  bits[ (i+k)/64 ] |= uint64_t(1) << ((i+k)%64);
+	}
+      }
+    }
+    for( ; i < last; ++i ) {
+      if( p_accepts( word(i) ) ) {
+	bits[ i/64 ] |= uint64_t(1) << (i%64);
+      }
+    }
+  }
+
+  // threads get whole elements of the bitmap, so none share one
+  template<class Words>
+  bitmap accepts_each( size_t n, unsigned threads, Words const &word ) const {
+    bitmap bits( (n+63)/64, 0 );
+    size_t jobs = std::max<size_t>( 1, std::min<size_t>( threads, n/per_thread ) );
+    size_t chunk = ( (n+jobs-1)/jobs + 63 ) / 64 * 64;
+    vector<std::thread> pool;
+    for( size_t first = chunk; first < n; first += chunk ) {
+      pool.emplace_back( [&,first]() {
+	  match_range( word, first, std::min( n, first+chunk ), bits.data() );
+	} );
+    }
+    match_range( word, 0, std::min( n, chunk ), bits.data() );
+    for( std::thread &t : pool ) {
+      t.join();
+    }
+    return bits;
+  }
+
+public:
+
+  size_t transitions() const {
+    size_t n = 0;
+    for( size_t i=0; i < size_t(states)*classes; ++i ) {
+      n += next[i]!=0;
+    }
+    return n;
+  }
+};
+
+
+// finds every occurrence of the words a dfa accepts in a stream of
+// text: Aho-Corasick over the trie that accept(string) builds. The
+// failure links are folded into a full transition table, so a step
+// is one load. States with something to report are numbered last, so
+// spotting them is one comparison. Words get ids breadth first.
+class scanner {
+public:
+  typedef uint32_t index;
+
+private:
+  unsigned char alphabet[256];
+  unsigned classes;
+  // states x classes, premultiplied targets
+  vector<index> next;
+  // premultiplied states from here on end a word or have a suffix
+  // that does
+  index first_output;
+  // by state: the word it ends or -1, and the next state down its
+  // failure chain that ends a word, or 0
+  vector<int32_t> word_of;
+  vector<index> dict;
+  // by word: the trie state that ends it, with each trie state's
+  // parent and the byte from it, to spell words out
+  vector<index> word_end;
+  vector<index> parent;
+  string via;
+  vector<uint32_t> lengths;
+
+public:
+  explicit scanner( dfa const &d ) {
+    typedef dfa::state state;
+
+    // the trie, breadth first
+    map<state,index> number;
+    vector<state> order( 1, state(dfa::START) );
+    number[dfa::START] = 0;
+    parent.push_back(0);
+    via.push_back(0);
+    for( size_t i=0; i<order.size(); ++i ) {
+      for( auto it = d.first_of( order[i] ); it != d.transition.t.end() && it->first.s==order[i]; ++it ) {
+	if( !number.emplace( it->second, order.size() ).second ) {
+	  throw runtime_error("The scanner needs a trie; build the dfa with accept(string).");
+	}
+	order.push_back( it->second );
+	parent.push_back( i );
+	via.push_back( it->first.c );
+      }
+    }
+    index n = order.size();
+
+    // byte classes, as compiled_dfa makes them
+    unsigned cls[256] = {};
+    unsigned next_class = 1;
+    for( state s : order ) {
+      map<std::pair<unsigned,state>,unsigned> split;
+      for( auto it = d.first_of( s ); it != d.transition.t.end() && it->first.s==s; ++it ) {
+	unsigned char c = it->first.c;
+	auto k = split.emplace( std::make_pair( cls[c], it->second ), next_class );
+	if( k.second ) {
+	  ++next_class;
+	}
+	cls[c] = k.first->second;
+      }
+    }
+    map<unsigned,unsigned char> dense;
+    for( int c=0; c<256; ++c ) {
+      alphabet[c] = dense.emplace( cls[c], dense.size() ).first->second;
+    }
+    classes = dense.size();
+
+    // goto function, then failure links and the full table, a
+    // level at a time
+    const index none = index(-1);
+    vector<index> go( size_t(n)*classes, none ), fail( n, 0 ), delta( size_t(n)*classes, 0 );
+    for( index i=1; i<n; ++i ) {
+      go[ size_t(parent[i])*classes + alphabet[ (unsigned char)via[i] ] ] = i;
+    }
+    for( index s=0; s<n; ++s ) {
+      for( unsigned c=0; c<classes; ++c ) {
+	index child = go[ size_t(s)*classes + c ];
+	index below = s ? delta[ size_t(fail[s])*classes + c ] : 0;
+	if( child != none ) {
+	  fail[child] = below;
+	  delta[ size_t(s)*classes + c ] = child;
+	} else {
+	  delta[ size_t(s)*classes + c ] = below;
+	}
+      }
+    }
+
+    // words, and the nearest word down each failure chain; the
+    // empty word is never reported
+    vector<int32_t> word( n, -1 );
+    vector<index> down( n, 0 );
+    for( index s=1; s<n; ++s ) {
+      if( d.accept_states.count( order[s] ) ) {
+	word[s] = word_end.size();
+	word_end.push_back( s );
+	index len = 0;
+	for( index t=s; t; t=parent[t] ) {
+	  ++len;
+	}
+	lengths.push_back( len );
+      }
+      down[s] = word[ fail[s] ] >= 0 ? fail[s] : down[ fail[s] ];
+    }
+
+    // states that report go last
+    vector<index> renumber( n );
+    index at = 0;
+    for( int reports=0; reports<2; ++reports ) {
+      if( reports ) {
+	first_output = at*classes;
+      }
+      for( index s=0; s<n; ++s ) {
+	if( (word[s] >= 0 || down[s] != 0) == bool(reports) ) {
+	  renumber[s] = at++;
+	}
+      }
+    }
+    next.resize( size_t(n)*classes );
+    word_of.resize( n );
+    dict.resize( n );
+    for( index s=0; s<n; ++s ) {
+      index r = renumber[s];
+      for( unsigned c=0; c<classes; ++c ) {
+	next[ size_t(r)*classes + c ] = renumber[ delta[ size_t(s)*classes + c ] ]*classes;
+      }
+      word_of[r] = word[s];
+      dict[r] = down[s] ? renumber[ down[s] ] : 0;
+    }
+  }
+
+  size_t words() const { return word_end.size(); }
+
+  size_t length( index id ) const { return lengths[id]; }
+
+  string word( index id ) const {
+    string w;
+    for( index t = word_end[id]; t; t = parent[t] ) {
+      w += via[t];
+    }
+    return string( w.rbegin(), w.rend() );
+  }
+
+  // one pass over a stream, fed a chunk at a time. found( offset,
+  // id ) is called for each match, with the offset of its first byte
+  // from the start of the stream; matches may span chunks.
+  class stream {
+    scanner const *sc;
+    index s;
+    uint64_t seen;
+  public:
+    explicit stream( scanner const &sc ) : sc(&sc), s(0), seen(0) {}
+
+    template<class F>
+    void feed( string_view chunk, F found ) {
+      const index *table = sc->next.data();
+      const unsigned char *p = reinterpret_cast<const unsigned char*>( chunk.data() );
+      for( size_t i=0; i<chunk.size(); ++i ) {
+	s = table[ s + sc->alphabet[ p[i] ] ];
+	if( s >= sc->first_output ) {
+	  uint64_t end = seen + i + 1;
+	  for( index r = s/sc->classes; r; r = sc->dict[r] ) {
+	    if( sc->word_of[r] >= 0 ) {
+	      found( end - sc->lengths[ sc->word_of[r] ], index( sc->word_of[r] ) );
+	    }
+	  }
+	}
+      }
+      seen += chunk.size();
+    }
+
+    // bytes fed so far
+    uint64_t offset() const { return seen; }
+  };
 };
 
 
 typedef function<bool(string const &)> filter_fn;
 
-bool lowercase_first( string const &w ) {
+inline bool lowercase_first( string const &w ) {
   return w.size() > 0 ? islower(w[0]) : false;
 }
 
-filter_fn begins_with( string const &prefix ) {
+inline filter_fn begins_with( string const &prefix ) {
   return [prefix] ( string const &w ) {
     if( prefix.size() > w.size() ) {
       return false;
@@ -149,19 +999,211 @@ filter_fn begins_with( string const &prefix ) {
   };
 }
 
-filter_fn And( filter_fn a, filter_fn b ) {
+inline filter_fn And( filter_fn a, filter_fn b ) {
   return [a,b]( string const &w ) {
     return a(w) && b(w);
   };
 }
 
-filter_fn Or( filter_fn a, filter_fn b ) {
+inline filter_fn Or( filter_fn a, filter_fn b ) {
   return [a,b]( string const &w ) {
-    return a(w) && b(w);
+    return a(w) || b(w);
   };
 }
 
-void write_gv( dfa &d, ostream &out ) {
+// a filter made of parts that are themselves small automata, so that
+// it can be run over a word in one pass or multiplied into a dfa.
+// Parts: starts_with, first_is (the first byte is in a class),
+// all_are (every byte is), and &, | and ! of filters.
+class word_filter {
+  typedef enum { f_prefix, f_first, f_all, f_and, f_or, f_not } kind;
+  struct node {
+    kind k;
+    string prefix;
+    std::bitset<256> chars;
+    std::shared_ptr<const node> a, b;
+  };
+  std::shared_ptr<const node> top;
+
+  explicit word_filter( node const &n ) : top( std::make_shared<const node>(n) ) {}
+
+  template<class P>
+  static std::bitset<256> chars_where( P is ) {
+    std::bitset<256> b;
+    for( int c=0; c<256; ++c ) {
+      b[c] = bool( is( (unsigned char)c ) );
+    }
+    return b;
+  }
+
+public:
+  typedef uint32_t part_state;
+
+  static word_filter starts_with( string const &p ) {
+    node n = { f_prefix, p, {}, nullptr, nullptr };
+    return word_filter(n);
+  }
+
+  template<class P>
+  static word_filter first_is( P is ) {
+    node n = { f_first, "", chars_where(is), nullptr, nullptr };
+    return word_filter(n);
+  }
+
+  template<class P>
+  static word_filter all_are( P is ) {
+    node n = { f_all, "", chars_where(is), nullptr, nullptr };
+    return word_filter(n);
+  }
+
+  friend word_filter operator&( word_filter const &a, word_filter const &b ) {
+    node n = { f_and, "", {}, a.top, b.top };
+    return word_filter(n);
+  }
+
+  friend word_filter operator|( word_filter const &a, word_filter const &b ) {
+    node n = { f_or, "", {}, a.top, b.top };
+    return word_filter(n);
+  }
+
+  friend word_filter operator!( word_filter const &a ) {
+    node n = { f_not, "", {}, a.top, nullptr };
+    return word_filter(n);
+  }
+
+  // the parts, in the order their states are kept
+  class program {
+    vector<const node*> parts;
+    std::shared_ptr<const node> top;
+
+    void collect( const node *n ) {
+      if( n->k==f_and || n->k==f_or || n->k==f_not ) {
+	collect( n->a.get() );
+	if( n->b ) {
+	  collect( n->b.get() );
+	}
+      } else {
+	parts.push_back( n );
+      }
+    }
+
+    // evaluate n, taking part states from at in collect's order
+    bool eval( const node *n, const part_state *&at ) const {
+      switch( n->k ) {
+      case f_and: { bool a = eval( n->a.get(), at ); return eval( n->b.get(), at ) && a; }
+      case f_or: { bool a = eval( n->a.get(), at ); return eval( n->b.get(), at ) || a; }
+      case f_not: return !eval( n->a.get(), at );
+      case f_prefix: return *at++ == n->prefix.size();
+      case f_first: return *at++ == 1;
+      case f_all: return *at++ == 0;
+      }
+      return false;
+    }
+
+  public:
+    explicit program( word_filter const &f ) : top( f.top ) {
+      collect( top.get() );
+    }
+
+    size_t size() const { return parts.size(); }
+
+    // every part starts in state 0
+    vector<part_state> start() const { return vector<part_state>( parts.size(), 0 ); }
+
+    // a prefix of length n is matched in state n and missed in
+    // n+1. first_is is undecided in 0, passed in 1 and failed in 2;
+    // all_are holds in 0 and fails in 1.
+    void step( vector<part_state> &s, unsigned char c ) const {
+      for( size_t i=0; i<parts.size(); ++i ) {
+	const node *n = parts[i];
+	switch( n->k ) {
+	case f_prefix:
+	  if( s[i] < n->prefix.size() ) {
+	    s[i] = (unsigned char)n->prefix[ s[i] ]==c ? s[i]+1 : n->prefix.size()+1;
+	  }
+	  break;
+	case f_first:
+	  if( s[i]==0 ) {
+	    s[i] = n->chars[c] ? 1 : 2;
+	  }
+	  break;
+	case f_all:
+	  if( !n->chars[c] ) {
+	    s[i] = 1;
+	  }
+	  break;
+	default:
+	  break;
+	}
+      }
+    }
+
+    // whether no further bytes can change any part
+    bool settled( vector<part_state> const &s ) const {
+      for( size_t i=0; i<parts.size(); ++i ) {
+	const node *n = parts[i];
+	bool done = n->k==f_prefix ? s[i] >= n->prefix.size() : s[i] != 0;
+	if( !done ) {
+	  return false;
+	}
+      }
+      return true;
+    }
+
+    bool passes( vector<part_state> const &s ) const {
+      const part_state *at = s.data();
+      return eval( top.get(), at );
+    }
+  };
+
+  // one pass over w, stepping every part together
+  bool operator()( string const &w ) const {
+    program p( *this );
+    vector<part_state> s = p.start();
+    for( char c : w ) {
+      p.step( s, c );
+    }
+    return p.passes( s );
+  }
+};
+
+
+inline dfa dfa::filtered( word_filter const &f ) const {
+  word_filter::program p( f );
+  dfa out;
+
+  // product states by this dfa's state and the parts' states
+  typedef std::pair< state, vector<word_filter::part_state> > pair_state;
+  map<pair_state,state> number;
+  vector<pair_state> todo( 1, pair_state( START, p.start() ) );
+  number[ todo[0] ] = START;
+  while( !todo.empty() ) {
+    pair_state at = todo.back();
+    todo.pop_back();
+    state from = number[at];
+    if( accept_states.count( at.first ) && p.passes( at.second ) ) {
+      out.accept_states.insert( from );
+    }
+    for( auto it = first_of( at.first ); it != transition.t.end() && it->first.s==at.first; ++it ) {
+      pair_state to( it->second, at.second );
+      p.step( to.second, it->first.c );
+      if( p.settled( to.second ) && !p.passes( to.second ) ) {
+	continue;
+      }
+      auto k = number.emplace( to, out.new_state_counter );
+      if( k.second ) {
+	++out.new_state_counter;
+	todo.push_back( to );
+      }
+      out.transition.augment( from, it->first.c, k.first->second );
+    }
+  }
+  out.made_states = out.new_state_counter;
+  out.made_transitions = out.transition.t.size();
+  return out;
+}
+
+inline void write_gv( dfa &d, ostream &out ) {
   out << "digraph words {\n";
   out << "\t" << "size=\"20,20\";\n";
   for( auto it=d.transition.t.begin(); it != d.transition.t.end(); ++it ) {
@@ -169,3 +1211,5 @@ void write_gv( dfa &d, ostream &out ) {
   }
   out << "}\n";
 }
+
+#endif
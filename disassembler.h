@@ -0,0 +1,96 @@
+#ifndef DISASSEMBLER_H
+#define DISASSEMBLER_H
+
+#include <iostream>
+#include <cctype>
+
+#include "vm.h"
+#include "vm-default.h"
+
+using std::ostream;
+
+// an address operand as h64k-as would write it: mode bits
+// 100 = code segment, 010 = stack, neither = register; 001 = indirect.
+inline void
+write_address( ostream &out, unsigned mod, unsigned loc )
+{
+  bool indirect( mod & mod_ra );
+  if( indirect ) out << "[";
+  if( mod & mod_code )
+    {
+      out << "code";
+      if( mod & mod_sv ) out << "+stack";
+    }
+  else if( mod & mod_sv )
+    out << "stack";
+  else
+    out << "reg";
+  out << ":" << loc;
+  if( indirect ) out << "]";
+}
+
+// write one instruction in assembler syntax. Codes that are not
+// built in are written as a comment, since their form is unknown.
+inline void
+disassemble( ostream &out, vm::instruction ins )
+{
+  if( ins.instr >= builtin_count )
+    {
+      out << "! instruction " << ins.instr << " (" << vm::convert(ins).s_arg << ")";
+      return;
+    }
+
+  const builtin &b( builtins[ins.instr] );
+  vm::conversion c( vm::convert(ins) );
+  out << b.name;
+  switch( b.form )
+    {
+    case form_noargs:
+      break;
+    case form_short:
+      out << " " << c.s_arg;
+      break;
+    case form_chars:
+      if( std::isprint(c.c_args.c0) && std::isprint(c.c_args.c1)
+	  && c.c_args.c0 != '\'' && c.c_args.c1 != '\'' )
+	out << " '" << c.c_args.c0 << c.c_args.c1 << "'";
+      else
+	out << " " << int(c.c_args.c0) << ", " << int(c.c_args.c1);
+      break;
+    case form_regs:
+      out << " ";
+      write_address( out, c.i_args.src_mod, c.i_args.src );
+      out << ", ";
+      write_address( out, c.i_args.dst_mod, c.i_args.dst );
+      break;
+    case form_xaddr:
+      out << " ";
+      write_address( out, c.x_args.a_mod, c.x_args.a_loc );
+      break;
+    case form_scalar:
+      out << " ";
+      write_address( out, c.s_args.a_mod, c.s_args.a_loc );
+      out << ", " << c.s_args.len;
+      break;
+    }
+  out << ";";
+}
+
+// list the program segment up to its last non-zero word
+template<unsigned Words, class Segment>
+void
+disassemble( ostream &out, basic_vm<Words,Segment> &machine )
+{
+  int last( int(segment_used(machine.program))-1 );
+  while( last >= 0 && machine.program[last]==0 )
+    --last;
+
+  for( int i=0; i<=last; ++i )
+    {
+      out << i << ":\t";
+      disassemble( out, vm::to_instruction(machine.program[i]) );
+      out << "\n";
+    }
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <vector>
+#include <algorithm>
+
+#include "vm.h"
+#include "vm-default.h"
+#include "object.h"
+
+using std::vector;
+
+// facts about the code in an object, shared by the passes that
+// rewrite objects before they are linked.
+
+constexpr unsigned short op_jmp_l    = builtin_code("jmp-l");
+constexpr unsigned short op_call_l   = builtin_code("call-l");
+constexpr unsigned short op_j_e      = builtin_code("j-e");
+constexpr unsigned short op_j_x      = builtin_code("j-x");
+constexpr unsigned short op_call_x   = builtin_code("call-x");
+constexpr unsigned short op_setw_l   = builtin_code("setw-l");
+constexpr unsigned short op_push_l   = builtin_code("push-l");
+constexpr unsigned short op_push_a   = builtin_code("push-a");
+constexpr unsigned short op_pop_a    = builtin_code("pop-a");
+constexpr unsigned short op_return   = builtin_code("return");
+constexpr unsigned short op_return_l = builtin_code("return-l");
+constexpr unsigned short op_return_x = builtin_code("return-x");
+constexpr unsigned short op_halt     = builtin_code("halt");
+constexpr unsigned short op_inc_x    = builtin_code("inc-x");
+constexpr unsigned short op_dec_x    = builtin_code("dec-x");
+constexpr unsigned short op_cmp_r    = builtin_code("cmp-r");
+constexpr unsigned short op_lambda_l = builtin_code("lambda-l");
+
+// registers below A have jobs (IP, SP, W, ZF, HALTED)
+const unsigned first_general_register = 5;
+
+inline unsigned short word_op( int word ) { return (word >> 16) & 0xFFFF; }
+inline unsigned short word_arg( int word ) { return word & 0xFFFF; }
+
+// what the linker will do to one word
+typedef struct
+{
+  // the opcode is a user mnemonic's
+  bool opcode;
+  // and this is its symbol, or -1
+  int mnem;
+  // symbol of a short or x-address label reference, or -1
+  int label;
+} reloc_info;
+
+inline vector<reloc_info>
+relocation_map( object_file const &o )
+{
+  vector<reloc_info> rel( o.code.size(), reloc_info{ false, -1, -1 } );
+  for( const object_file::relocation &r : o.relocations )
+    {
+      if( r.kind==object_file::rel_opcode )
+	{
+	  rel[r.offset].opcode = true;
+	  rel[r.offset].mnem = r.sym;
+	}
+      else
+	rel[r.offset].label = r.sym;
+    }
+  return rel;
+}
+
+// word i is the built-in instruction c, not a user mnemonic that
+// happens to have the same number before linking
+inline bool
+is_builtin( object_file const &o, vector<reloc_info> const &rel, unsigned i, unsigned short c )
+{
+  return !rel[i].opcode && word_op(o.code[i])==c;
+}
+
+// passes that move code only work if every code address in the
+// object goes through a label the linker can move: jump targets, and
+// operands in the code segment, which are data the code may read or
+// write.
+inline bool
+has_absolute_addresses( object_file const &o, vector<reloc_info> const &rel )
+{
+  for( unsigned i=0; i<o.code.size(); ++i )
+    {
+      if( rel[i].opcode || rel[i].label >= 0 ) continue;
+      unsigned short c( word_op(o.code[i]) );
+      vm::conversion a;
+      a.s_arg = word_arg(o.code[i]);
+
+      if( c==op_jmp_l || c==op_call_l || c==op_j_e || c==op_setw_l )
+	return true;
+      // j-x and call-x among them
+      if( c<builtin_count && (builtins[c].form==form_xaddr || builtins[c].form==form_scalar)
+	  && (a.x_args.a_mod & mod_code) )
+	return true;
+      // push-l n; return is a computed jump to n
+      if( c==op_push_l && i+1<o.code.size() && is_builtin( o, rel, i+1, op_return ) )
+	return true;
+    }
+  return false;
+}
+
+// offsets of the lambda-l instructions, in order
+inline vector<unsigned>
+lambda_sites( object_file const &o, vector<reloc_info> const &rel )
+{
+  vector<unsigned> sites;
+  for( unsigned i=0; i<o.code.size(); ++i )
+    {
+      if( is_builtin( o, rel, i, op_lambda_l ) && rel[i].label<0 )
+	sites.push_back(i);
+    }
+  return sites;
+}
+
+// one past the last word of the lambda body defined at site
+inline unsigned
+lambda_end( object_file const &o, unsigned site )
+{
+  return std::min<unsigned>( o.code.size(), site+1+word_arg(o.code[site]) );
+}
+
+// delete the words marked dead. Lambdas shrink around words removed
+// from their bodies; labels on dead words move to the next word kept.
+inline void
+remove_words( object_file &o, vector<bool> const &dead )
+{
+  unsigned n( o.code.size() );
+
+  for( unsigned l : lambda_sites( o, relocation_map(o) ) )
+    {
+      if( dead[l] ) continue;
+      unsigned removed(0);
+      for( unsigned j=l+1; j<lambda_end(o,l); ++j ) removed += dead[j];
+      o.code[l] -= removed;
+    }
+
+  vector<unsigned> moved( n+1 );
+  unsigned at(0);
+  for( unsigned i=0; i<n; ++i )
+    {
+      moved[i] = at;
+      if( !dead[i] ) o.code[at++] = o.code[i];
+    }
+  moved[n] = at;
+  o.code.resize(at);
+
+  for( object_file::symbol &s : o.symbols )
+    {
+      if( s.kind==object_file::sym_label && s.defined )
+	s.value = moved[s.value];
+    }
+
+  vector<object_file::relocation> kept;
+  for( object_file::relocation r : o.relocations )
+    {
+      if( dead[r.offset] ) continue;
+      r.offset = moved[r.offset];
+      kept.push_back(r);
+    }
+  o.relocations.swap(kept);
+}
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include <algorithm>
+
+using std::vector;
+using std::unordered_map;
+using std::runtime_error;
+
+// the allocator behind the alloc, free and realloc instructions. It
+// hands out blocks of a region of the stack segment, but keeps all
+// of its own records outside the machine, where guests cannot
+// trample them.
+//
+// Small blocks come from slabs of slab_words words, each slab cut
+// into blocks of one power-of-two size; freed small blocks wait on
+// a free list for their size. Blocks bigger than half a slab take a
+// run of whole slabs, and freed runs are merged with their
+// neighbours. Address 0 is never a block, so it stands for failure.
+class guest_heap
+{
+ public:
+  static const unsigned slab_words = 256;
+
+  typedef enum
+    {
+      stat_in_use,      // words asked for by live blocks
+      stat_blocks,      // live blocks
+      stat_free,        // words of the region not in a live block
+      stat_peak,        // most words ever in use at once
+      stat_allocations, // successful alloc and realloc calls
+      stat_failures,    // calls that returned 0
+      stat_count
+    } stat;
+
+ private:
+  static const unsigned classes = 9; // 1 .. slab_words/2 words
+
+  int base;
+  unsigned words;
+  // next slab not yet cut from the region
+  unsigned next_slab;
+
+  // free blocks of each small size
+  vector<int> free_small[classes];
+  // free runs of whole slabs, by address
+  vector<std::pair<int,unsigned> > free_runs;
+
+  typedef struct
+  {
+    unsigned asked;
+    unsigned capacity;
+  } block;
+  unordered_map<int,block> live;
+
+  int stats[stat_count];
+
+  static unsigned
+    class_of( unsigned n )
+  {
+    unsigned c(0);
+    while( (1u<<c) < n ) ++c;
+    return c;
+  }
+
+  static unsigned
+    slabs_for( unsigned n )
+  {
+    return (n + slab_words-1)/slab_words;
+  }
+
+  // take n whole slabs, from a freed run if one is big enough
+  int
+    take_slabs( unsigned n )
+  {
+    for( unsigned i=0; i<free_runs.size(); ++i )
+      {
+	if( free_runs[i].second < n ) continue;
+	int at( free_runs[i].first );
+	free_runs[i].first += n*slab_words;
+	free_runs[i].second -= n;
+	if( free_runs[i].second==0 )
+	  free_runs.erase( free_runs.begin()+i );
+	return at;
+      }
+    if( next_slab + n > words/slab_words )
+      return 0;
+    int at( base + next_slab*slab_words );
+    next_slab += n;
+    return at;
+  }
+
+  void
+    give_slabs( int at, unsigned n )
+  {
+    auto i = std::lower_bound( free_runs.begin(), free_runs.end(), std::make_pair(at,0u) );
+    i = free_runs.insert( i, std::make_pair(at,n) );
+    // merge with the runs either side
+    if( i+1 != free_runs.end() && i->first + int(i->second*slab_words) == (i+1)->first )
+      {
+	i->second += (i+1)->second;
+	free_runs.erase(i+1);
+      }
+    if( i != free_runs.begin() && (i-1)->first + int((i-1)->second*slab_words) == i->first )
+      {
+	(i-1)->second += i->second;
+	free_runs.erase(i);
+      }
+  }
+
+  void
+    count( int address, unsigned n )
+  {
+    if( address==0 )
+      {
+	++stats[stat_failures];
+	return;
+      }
+    ++stats[stat_allocations];
+    stats[stat_in_use] += n;
+    stats[stat_peak] = std::max( stats[stat_peak], stats[stat_in_use] );
+  }
+
+ public:
+  guest_heap()
+    : base(0), words(0), next_slab(0), stats()
+  {}
+
+  bool ready() const { return words > 0; }
+
+  // manage words words of the stack segment from base. Anything
+  // allocated before is forgotten.
+  void
+    init( int at, unsigned n, unsigned segment_words )
+  {
+    if( at < 64 || n < slab_words || unsigned(at) + n > segment_words )
+      throw runtime_error("The heap must be at least one slab, past the registers and inside the stack segment.");
+    *this = guest_heap();
+    base = at;
+    words = n - n%slab_words;
+    stats[stat_free] = words;
+  }
+
+  // a block of at least n words, or 0
+  int
+    alloc( unsigned n )
+  {
+    if( !ready() )
+      throw runtime_error("No heap; use heap-init first.");
+    if( n==0 ) n = 1;
+    if( n > words )
+      {
+	count( 0, n );
+	return 0;
+      }
+
+    int at(0);
+    unsigned capacity(0);
+    if( n <= slab_words/2 )
+      {
+	unsigned c( class_of(n) );
+	capacity = 1u<<c;
+	if( free_small[c].empty() )
+	  {
+	    int slab( take_slabs(1) );
+	    // carve the slab, leaving the lowest block on top
+	    for( unsigned k=slab ? slab_words/capacity : 0; k>0; --k )
+	      free_small[c].push_back( slab + (k-1)*capacity );
+	  }
+	if( !free_small[c].empty() )
+	  {
+	    at = free_small[c].back();
+	    free_small[c].pop_back();
+	  }
+      }
+    else
+      {
+	capacity = slabs_for(n)*slab_words;
+	at = take_slabs( slabs_for(n) );
+      }
+
+    count( at, n );
+    if( at )
+      {
+	live[at] = block{ n, capacity };
+	stats[stat_blocks] = live.size();
+	stats[stat_free] -= capacity;
+      }
+    return at;
+  }
+
+  // words asked for when address was allocated
+  unsigned
+    size_of( int address ) const
+  {
+    auto b = live.find(address);
+    if( b==live.end() )
+      throw runtime_error("Not an allocated block.");
+    return b->second.asked;
+  }
+
+  void
+    release( int address )
+  {
+    if( address==0 ) return;
+    auto b = live.find(address);
+    if( b==live.end() )
+      throw runtime_error("Freeing something that is not an allocated block.");
+    unsigned capacity( b->second.capacity );
+    stats[stat_in_use] -= b->second.asked;
+    stats[stat_free] += capacity;
+    live.erase(b);
+    stats[stat_blocks] = live.size();
+
+    if( capacity < slab_words )
+      free_small[ class_of(capacity) ].push_back(address);
+    else
+      give_slabs( address, capacity/slab_words );
+  }
+
+  // let a block hold n words without moving it, if it has room
+  bool
+    resize( int address, unsigned n )
+  {
+    auto b = live.find(address);
+    if( b==live.end() )
+      throw runtime_error("Resizing something that is not an allocated block.");
+    if( n==0 ) n = 1;
+    // small blocks stay in their class, so they can be found again
+    unsigned capacity( b->second.capacity );
+    if( n > capacity || (capacity < slab_words && class_of(n) != class_of(capacity)) )
+      return false;
+    stats[stat_in_use] += int(n) - int(b->second.asked);
+    stats[stat_peak] = std::max( stats[stat_peak], stats[stat_in_use] );
+    ++stats[stat_allocations];
+    b->second.asked = n;
+    return true;
+  }
+
+  int
+    statistic( unsigned s ) const
+  {
+    if( s >= stat_count )
+      throw runtime_error("No such heap statistic.");
+    return stats[s];
+  }
+};
+
+#endif
@@ -0,0 +1,383 @@
+#ifndef IR_H
+#define IR_H
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#include "vm.h"
+#include "vm-default.h"
+
+using std::vector;
+using std::string;
+using std::runtime_error;
+
+// the compiler's code before registers are chosen: instructions in
+// the machine's two-address shape over any number of virtual
+// registers, with jumps to numbered labels.
+typedef uint32_t vreg;
+
+typedef enum
+  {
+    ir_li,     // d = value, which fits in 16 bits
+    ir_mov,    // d = s
+    ir_add,    // d += s, and so on
+    ir_sub,
+    ir_mul,
+    ir_div,
+    ir_and,
+    ir_or,
+    ir_lsh,    // d <<= value
+    ir_rsh,    // d >>= value
+    ir_dec,    // --d
+    ir_cmp,    // flag = d==s
+    ir_je,     // to label value if flag
+    ir_jmp,    // to label value
+    ir_label,  // label value is here
+    ir_print,  // print s
+    ir_chars,  // print the two characters in value
+    ir_halt
+  } ir_op;
+
+typedef struct
+{
+  ir_op op;
+  vreg d, s;
+  int32_t value;
+} ir_instruction;
+
+class ir_program
+{
+ public:
+  vector<ir_instruction> code;
+  unsigned vregs;
+  unsigned labels;
+
+  ir_program() : vregs(0), labels(0) {}
+
+  vreg fresh() { return vregs++; }
+  unsigned label() { return labels++; }
+
+  void
+    emit( ir_op op, vreg d = 0, vreg s = 0, int32_t value = 0 )
+  {
+    code.push_back( ir_instruction{ op, d, s, value } );
+  }
+
+  // what an instruction reads and writes
+  static bool reads_d( ir_op op ) { return op>=ir_add && op<=ir_cmp; }
+  static bool reads_s( ir_op op ) { return op==ir_mov || (op>=ir_add && op<=ir_or) || op==ir_cmp || op==ir_print; }
+  static bool writes_d( ir_op op ) { return op<=ir_dec; }
+};
+
+// where each virtual register lives: one of the general registers
+// A..V while there are enough, else one of the registers from 29 up,
+// which every instruction form can still name directly.
+//
+// Liveness is found per basic block and widened into one interval
+// per virtual register, and the intervals are handed registers in
+// order of their starts (Poletto and Sarkar's linear scan). When a
+// mov's source dies where its destination is born the two are given
+// the same register if it is free, and the mov disappears.
+class register_allocation
+{
+ public:
+  static const unsigned first_general = 5;  // A
+  static const unsigned last_general = 25;  // V
+  static const unsigned first_spill = 29;
+  static const unsigned registers = 64;
+
+  vector<unsigned> where;
+  // how many values had to live outside A..V
+  unsigned spilled;
+
+ private:
+  typedef struct
+  {
+    int start, end;
+    // born by being written, not read, at start
+    bool born_written;
+    vreg v;
+  } interval;
+
+  // basic blocks: [first, last] of the code, and successors
+  typedef struct
+  {
+    unsigned first, last;
+    vector<unsigned> next;
+    vector<bool> live_in, live_out;
+  } block;
+
+  static vector<block>
+    blocks_of( ir_program const &p )
+  {
+    vector<block> blocks;
+    vector<int> block_of_label( p.labels, -1 );
+    unsigned n( p.code.size() );
+    unsigned start(0);
+    for( unsigned i=0; i<n; ++i )
+      {
+	ir_op op( p.code[i].op );
+	bool ends( op==ir_je || op==ir_jmp || op==ir_halt || i+1==n
+		   || p.code[i+1].op==ir_label );
+	if( op==ir_label )
+	  block_of_label[ p.code[i].value ] = blocks.size();
+	if( ends )
+	  {
+	    blocks.push_back( block{ start, i, {}, {}, {} } );
+	    start = i+1;
+	  }
+      }
+    for( unsigned b=0; b<blocks.size(); ++b )
+      {
+	ir_instruction const &last( p.code[ blocks[b].last ] );
+	if( last.op==ir_je || last.op==ir_jmp )
+	  blocks[b].next.push_back( block_of_label[last.value] );
+	if( last.op!=ir_jmp && last.op!=ir_halt && b+1<blocks.size() )
+	  blocks[b].next.push_back( b+1 );
+      }
+    return blocks;
+  }
+
+ public:
+  // general registers from first up; a lambda call overwrites A, so
+  // code with calls in it leaves A alone
+  register_allocation( ir_program const &p, unsigned first = first_general )
+    : where( p.vregs, 0 ), spilled(0)
+  {
+    unsigned n( p.code.size() );
+    vector<block> blocks( blocks_of(p) );
+
+    // liveness, to a fixed point
+    for( block &b : blocks )
+      {
+	b.live_in.assign( p.vregs, false );
+	b.live_out.assign( p.vregs, false );
+      }
+    for( bool changed(true); changed; )
+      {
+	changed = false;
+	for( unsigned b=blocks.size(); b-- > 0; )
+	  {
+	    block &k( blocks[b] );
+	    vector<bool> live( p.vregs, false );
+	    for( unsigned s : k.next )
+	      for( vreg v=0; v<p.vregs; ++v )
+		live[v] = live[v] || blocks[s].live_in[v];
+	    k.live_out = live;
+	    for( unsigned i=k.last+1; i-- > k.first; )
+	      {
+		ir_instruction const &x( p.code[i] );
+		if( ir_program::writes_d(x.op) ) live[x.d] = false;
+		if( ir_program::reads_d(x.op) ) live[x.d] = true;
+		if( ir_program::reads_s(x.op) ) live[x.s] = true;
+	      }
+	    if( live != k.live_in )
+	      {
+		k.live_in = live;
+		changed = true;
+	      }
+	  }
+      }
+
+    // one interval per virtual register
+    vector<interval> spans( p.vregs, interval{ -1, -1, false, 0 } );
+    auto touch = [&]( vreg v, int at, bool written )
+      {
+	interval &s( spans[v] );
+	if( s.start < 0 || at < s.start )
+	  {
+	    s.start = at;
+	    s.born_written = written;
+	  }
+	s.end = std::max( s.end, at );
+      };
+    for( unsigned i=0; i<n; ++i )
+      {
+	ir_instruction const &x( p.code[i] );
+	if( ir_program::reads_s(x.op) ) touch( x.s, i, false );
+	if( ir_program::reads_d(x.op) ) touch( x.d, i, false );
+	else if( ir_program::writes_d(x.op) ) touch( x.d, i, true );
+      }
+    for( block const &b : blocks )
+      for( vreg v=0; v<p.vregs; ++v )
+	{
+	  if( b.live_in[v] ) touch( v, b.first, false );
+	  if( b.live_out[v] ) touch( v, b.last, false );
+	}
+
+    // a mov's destination would like its source's register
+    vector<int> hint( p.vregs, -1 );
+    for( ir_instruction const &x : p.code )
+      if( x.op==ir_mov ) hint[x.d] = x.s;
+
+    vector<interval> order;
+    for( vreg v=0; v<p.vregs; ++v )
+      if( spans[v].start >= 0 )
+	{
+	  spans[v].v = v;
+	  order.push_back( spans[v] );
+	}
+    std::sort( order.begin(), order.end(), []( interval const &a, interval const &b )
+	       { return a.start < b.start || (a.start==b.start && a.v < b.v); } );
+
+    // linear scan. A value read for the last time where another is
+    // written can hand its register on, since reads come first.
+    vector<bool> busy( registers, false );
+    vector<interval> active;
+    for( interval const &i : order )
+      {
+	for( unsigned k=0; k<active.size(); )
+	  {
+	    interval const &a( active[k] );
+	    if( a.end < i.start || (a.end==i.start && i.born_written) )
+	      {
+		busy[ where[a.v] ] = false;
+		active.erase( active.begin()+k );
+	      }
+	    else
+	      ++k;
+	  }
+
+	unsigned r(0);
+	int h( hint[i.v] );
+	if( h >= 0 && spans[h].start >= 0 && spans[h].end <= i.start
+	    && where[h] && !busy[ where[h] ] )
+	  r = where[h];
+	for( unsigned g=first; !r && g<=last_general; ++g )
+	  if( !busy[g] ) r = g;
+
+	if( !r )
+	  {
+	    // A..V are full: the value that lives longest moves out
+	    auto longest = std::max_element( active.begin(), active.end(),
+					     []( interval const &a, interval const &b )
+					     { return a.end < b.end || (a.end==b.end && a.v < b.v); } );
+	    unsigned slot(0);
+	    for( unsigned s=first_spill; !slot && s<registers; ++s )
+	      if( !busy[s] ) slot = s;
+	    if( !slot )
+	      throw runtime_error("Too many values live at once.");
+	    ++spilled;
+	    if( longest != active.end() && longest->end > i.end
+		&& where[longest->v] <= last_general )
+	      {
+		r = where[longest->v];
+		where[longest->v] = slot;
+	      }
+	    else
+	      r = slot;
+	    busy[slot] = true;
+	  }
+	where[i.v] = r;
+	busy[r] = true;
+	active.push_back(i);
+      }
+  }
+};
+
+// words of code whose jumps still name labels, so that passes can
+// move code about before it is placed at an address
+class machine_code
+{
+ public:
+  vector<int> words;
+  // for each word, the label it jumps to, or -1
+  vector<int> target;
+  // for each label, the word it is on
+  vector<int> label_at;
+
+  void
+    add( vm::instruction i, int label = -1 )
+  {
+    words.push_back( vm::int32(i) );
+    target.push_back( label );
+  }
+
+  // the words, loaded at base, with every jump aimed
+  vector<int>
+    placed( int base ) const
+  {
+    vector<int> code( words );
+    for( unsigned i=0; i<code.size(); ++i )
+      {
+	if( target[i] < 0 ) continue;
+	int at( base + label_at[ target[i] ] );
+	if( label_at[ target[i] ] < 0 || at > 0xFFFF )
+	  throw runtime_error("Jump to a label out of reach.");
+	code[i] = (code[i] & ~0xFFFF) | at;
+      }
+    return code;
+  }
+};
+
+// machine code for p, with registers as allocated
+inline machine_code
+emit_code( ir_program const &p, register_allocation const &regs )
+{
+  machine_code code;
+  code.label_at.assign( p.labels, -1 );
+
+  auto two = [&]( unsigned short op, unsigned src, unsigned dst )
+    {
+      vm::instruction i( vm::assemble(op) );
+      i.src = src;
+      i.dst = dst;
+      code.add(i);
+    };
+
+  for( ir_instruction const &x : p.code )
+    {
+      unsigned d( x.op<=ir_cmp ? regs.where[x.d] : 0 );
+      unsigned s( ir_program::reads_s(x.op) ? regs.where[x.s] : 0 );
+      switch( x.op )
+	{
+	case ir_li:
+	  code.add( vm::assemble( builtin_code("push-l"), (unsigned short)x.value ) );
+	  code.add( vm::assemble( builtin_code("pop-a"), (unsigned short)d ) );
+	  break;
+	case ir_mov:
+	  if( d==s ) break;
+	  code.add( vm::assemble( builtin_code("push-a"), (unsigned short)s ) );
+	  code.add( vm::assemble( builtin_code("pop-a"), (unsigned short)d ) );
+	  break;
+	case ir_add: two( builtin_code("add-r"), s, d ); break;
+	case ir_sub: two( builtin_code("sub-r"), s, d ); break;
+	case ir_mul: two( builtin_code("mul-r"), s, d ); break;
+	case ir_div: two( builtin_code("div-r"), s, d ); break;
+	case ir_and: two( builtin_code("and-r"), s, d ); break;
+	case ir_or:  two( builtin_code("or-r"), s, d ); break;
+	case ir_cmp: two( builtin_code("cmp-r"), s, d ); break;
+	case ir_lsh:
+	  code.add( vm::assemble_scalar( builtin_code("lsh"), mod_rv, d, x.value ) );
+	  break;
+	case ir_rsh:
+	  code.add( vm::assemble_scalar( builtin_code("rsh"), mod_rv, d, x.value ) );
+	  break;
+	case ir_dec:
+	  code.add( vm::assemble_xaddr( builtin_code("dec-x"), mod_rv, d ) );
+	  break;
+	case ir_je:
+	case ir_jmp:
+	  code.add( vm::assemble( builtin_code( x.op==ir_je ? "j-e" : "jmp-l" ), (unsigned short)0 ), x.value );
+	  break;
+	case ir_label:
+	  code.label_at[x.value] = code.words.size();
+	  break;
+	case ir_print:
+	  code.add( vm::assemble_xaddr( builtin_code("print-a-d"), mod_rv, s ) );
+	  break;
+	case ir_chars:
+	  code.add( vm::assemble( builtin_code("ouch2"), char(x.value>>8), char(x.value & 0xFF) ) );
+	  break;
+	case ir_halt:
+	  code.add( vm::assemble( builtin_code("halt") ) );
+	  break;
+	}
+    }
+  return code;
+}
+
+#endif
@@ -1,14 +1,331 @@
 #ifndef LANGUAGE_H
 #define LANGUAGE_H
 
-#include "vm.h"
+#include <vector>
+#include <unordered_map>
+#include <sstream>
+#include <stdexcept>
 
+#include "symbols.h"
+#include "ast.h"
+#include "ir.h"
+#include "outline.h"
 
+using std::vector;
+using std::unordered_map;
+using std::stringstream;
+using std::runtime_error;
 
+// turns a program's tree into words of code, to be loaded at base.
+// The tree is first lowered to the two-address code of ir.h, where
+// every variable and every intermediate value has a virtual register
+// of its own; register_allocation then packs those into A..V (and
+// from 29 up when they run out), so that arithmetic happens in place
+// on registers and values are copied only where they must be.
 class language
 {
+  ast const &tree;
+  int base;
+  ir_program ir;
+  unordered_map<symbol_table::symbol,vreg> variables;
+
+  [[noreturn]] void
+    fail( node_id n, string const &what )
+  {
+    stringstream s;
+    s << "line " << tree[n].line << ": " << what;
+    throw runtime_error(s.str());
+  }
+
+  vreg
+    variable( node_id n )
+  {
+    auto v = variables.find( tree[n].value );
+    if( v==variables.end() )
+      fail( n, "Variable used before it is assigned." );
+    return v->second;
+  }
+
+  // whether working out n reads d
+  bool
+    reads( node_id n, vreg d ) const
+  {
+    if( !n ) return false;
+    node const &e( tree[n] );
+    if( e.kind==n_variable )
+      {
+	auto v = variables.find( e.value );
+	return v!=variables.end() && v->second==d;
+      }
+    return reads( e.a, d ) || reads( e.b, d );
+  }
+
+  void
+    constant( int32_t v, vreg d )
+  {
+    uint32_t u(v);
+    if( u <= 0xFFFF )
+      {
+	ir.emit( ir_li, d, 0, u );
+	return;
+      }
+    // the high half, shifted up, then the low half or-ed in
+    vreg low( ir.fresh() );
+    ir.emit( ir_li, d, 0, u>>16 );
+    ir.emit( ir_lsh, d, 0, 16 );
+    ir.emit( ir_li, low, 0, u & 0xFFFF );
+    ir.emit( ir_or, d, low );
+  }
+
+  // a register holding n's value: a variable's own, or a new one
+  // with n worked out into it
+  vreg
+    value( node_id n )
+  {
+    if( tree[n].kind==n_variable )
+      return variable(n);
+    vreg t( ir.fresh() );
+    into( n, t );
+    return t;
+  }
+
+  // work out n into d. A binary operator works out its left side
+  // into d and applies its right side to it there, which is only
+  // safe if the right side does not read d; else the value is built
+  // elsewhere and copied.
+  void
+    into( node_id n, vreg d )
+  {
+    node const &e( tree[n] );
+    switch( e.kind )
+      {
+      case n_integer:
+	constant( e.value, d );
+	return;
+      case n_variable:
+	{
+	  vreg v( variable(n) );
+	  if( v!=d ) ir.emit( ir_mov, d, v );
+	  return;
+	}
+      case n_unary:
+	{
+	  vreg r( value( e.a ) );
+	  if( r==d )
+	    {
+	      vreg t( ir.fresh() );
+	      ir.emit( ir_li, t, 0, 0 );
+	      ir.emit( ir_sub, t, r );
+	      ir.emit( ir_mov, d, t );
+	      return;
+	    }
+	  ir.emit( ir_li, d, 0, 0 );
+	  ir.emit( ir_sub, d, r );
+	  return;
+	}
+      case n_binary:
+	break;
+      default:
+	fail( n, "Not an expression." );
+      }
+
+    node_op op( node_op(e.op) );
+    if( op==op_eq || op==op_ne )
+      {
+	// the flag survives the li that sets d
+	vreg a( value( e.a ) ), b( value( e.b ) );
+	unsigned done( ir.label() );
+	ir.emit( ir_cmp, a, b );
+	ir.emit( ir_li, d, 0, op==op_eq );
+	ir.emit( ir_je, 0, 0, done );
+	ir.emit( ir_li, d, 0, op!=op_eq );
+	ir.emit( ir_label, 0, 0, done );
+	return;
+      }
+
+    bool ordered( op==op_lt || op==op_gt || op==op_le || op==op_ge );
+    bool swap( op==op_gt || op==op_ge );
+    node_id left( swap ? e.b : e.a ), right( swap ? e.a : e.b );
+    if( reads( right, d ) )
+      {
+	vreg t( ir.fresh() );
+	into( n, t );
+	ir.emit( ir_mov, d, t );
+	return;
+      }
+
+    into( left, d );
+    vreg r( value( right ) );
+    if( ordered )
+      {
+	// a < b when a-b is negative; a <= b when a-b-1 is. That
+	// overflows when the signs differ, but then a is below b just
+	// when it is the negative one
+	vreg sa( ir.fresh() ), sb( ir.fresh() );
+	unsigned same( ir.label() ), done( ir.label() );
+	ir.emit( ir_mov, sa, d );
+	ir.emit( ir_rsh, sa, 0, 31 );
+	ir.emit( ir_mov, sb, r );
+	ir.emit( ir_rsh, sb, 0, 31 );
+	ir.emit( ir_cmp, sa, sb );
+	ir.emit( ir_je, 0, 0, same );
+	ir.emit( ir_mov, d, sa );
+	ir.emit( ir_jmp, 0, 0, done );
+	ir.emit( ir_label, 0, 0, same );
+	ir.emit( ir_sub, d, r );
+	if( op==op_le || op==op_ge )
+	  ir.emit( ir_dec, d );
+	ir.emit( ir_rsh, d, 0, 31 );
+	ir.emit( ir_label, 0, 0, done );
+	vreg one( ir.fresh() );
+	ir.emit( ir_li, one, 0, 1 );
+	ir.emit( ir_and, d, one );
+	return;
+      }
+    switch( op )
+      {
+      case op_add: ir.emit( ir_add, d, r ); return;
+      case op_sub: ir.emit( ir_sub, d, r ); return;
+      case op_mul: ir.emit( ir_mul, d, r ); return;
+      case op_div: ir.emit( ir_div, d, r ); return;
+      case op_and: ir.emit( ir_and, d, r ); return;
+      case op_or:  ir.emit( ir_or, d, r ); return;
+      default:
+	fail( n, "Unknown operator." );
+      }
+  }
+
+  // jump to the label returned, yet to be placed, if n is false
+  unsigned
+    unless( node_id n )
+  {
+    node const &e( tree[n] );
+    unsigned skip( ir.label() );
+    if( e.kind==n_binary && (e.op==op_eq || e.op==op_ne) )
+      {
+	vreg a( value( e.a ) ), b( value( e.b ) );
+	ir.emit( ir_cmp, a, b );
+	if( e.op==op_ne )
+	  {
+	    ir.emit( ir_je, 0, 0, skip );
+	    return skip;
+	  }
+	unsigned taken( ir.label() );
+	ir.emit( ir_je, 0, 0, taken );
+	ir.emit( ir_jmp, 0, 0, skip );
+	ir.emit( ir_label, 0, 0, taken );
+	return skip;
+      }
+    vreg r( value(n) ), zero( ir.fresh() );
+    ir.emit( ir_li, zero, 0, 0 );
+    ir.emit( ir_cmp, r, zero );
+    ir.emit( ir_je, 0, 0, skip );
+    return skip;
+  }
+
+  void
+    print( node_id item )
+  {
+    if( tree[item].kind==n_string )
+      {
+	// two characters a word; an odd one out is paired with 0,
+	// which ouch2 does not print
+	string_view s( tree.text(item) );
+	for( std::size_t i=0; i<s.size(); i+=2 )
+	  {
+	    unsigned char first( s[i] ), second( i+1<s.size() ? s[i+1] : '\0' );
+	    ir.emit( ir_chars, 0, 0, first<<8 | second );
+	  }
+	return;
+      }
+    ir.emit( ir_print, 0, value(item) );
+  }
+
+  void
+    statement( node_id n )
+  {
+    node const &s( tree[n] );
+    switch( s.kind )
+      {
+      case n_block:
+	for( node_id i=s.a; i; i=tree[i].next )
+	  statement(i);
+	return;
+      case n_assign:
+	{
+	  auto v = variables.find( s.value );
+	  if( v!=variables.end() )
+	    {
+	      into( s.a, v->second );
+	      return;
+	    }
+	  // the value is worked out before the variable exists, so it
+	  // cannot read it; the copy goes when both share a register
+	  vreg t( value( s.a ) );
+	  vreg x( ir.fresh() );
+	  variables.emplace( s.value, x );
+	  ir.emit( ir_mov, x, t );
+	  return;
+	}
+      case n_print:
+	for( node_id i=s.a; i; i=tree[i].next )
+	  print(i);
+	return;
+      case n_if:
+	{
+	  unsigned skip( unless( s.a ) );
+	  statement( s.b );
+	  if( s.c )
+	    {
+	      unsigned over( ir.label() );
+	      ir.emit( ir_jmp, 0, 0, over );
+	      ir.emit( ir_label, 0, 0, skip );
+	      statement( s.c );
+	      ir.emit( ir_label, 0, 0, over );
+	    }
+	  else
+	    ir.emit( ir_label, 0, 0, skip );
+	  return;
+	}
+      case n_while:
+	{
+	  unsigned top( ir.label() );
+	  ir.emit( ir_label, 0, 0, top );
+	  unsigned leave( unless( s.a ) );
+	  statement( s.b );
+	  ir.emit( ir_jmp, 0, 0, top );
+	  ir.emit( ir_label, 0, 0, leave );
+	  return;
+	}
+      case n_halt:
+	ir.emit( ir_halt );
+	return;
+      default:
+	fail( n, "Not a statement." );
+      }
+  }
+
  public:
-  
+  language( ast const &tree, int base )
+    : tree(tree), base(base)
+  {}
+
+  // the whole program, ending in halt. If small, repeated code is
+  // outlined into lambdas, numbered from first_user.
+  vector<int>
+    compile( bool small = false, unsigned first_user = 0 )
+  {
+    ir = ir_program();
+    variables.clear();
+    statement( tree.root );
+    ir.emit( ir_halt );
+    register_allocation regs( ir, small ? register_allocation::first_general+1
+			      : register_allocation::first_general );
+    machine_code code( emit_code( ir, regs ) );
+    if( small )
+      outliner( code, first_user ).run();
+    return code.placed( base );
+  }
 };
 
 #endif
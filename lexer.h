@@ -1,28 +1,42 @@
 #ifndef LEXER
 #define LEXER
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <iterator>
 #include <cctype>
 #include <exception>
 #include <stdexcept>
-#include <deque>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "symbols.h"
+#include "dfa.h"
 
 using std::string;
+using std::string_view;
 using std::istream;
 using std::isspace;
 using std::isalpha;
 using std::runtime_error;
 using std::stringstream;
-using std::deque;
+using std::vector;
 
 typedef enum
   {
     ID,OP,INTEGER,FLOAT,D_STRING,S_STRING,END_OF_FILE, COMMENT
   } token_type;
 
-string 
+inline string
 token_type_name( token_type t )
 {
   if( t==ID) return "identifier";
@@ -31,272 +45,417 @@ token_type_name( token_type t )
   if( t==FLOAT ) return "float";
   if( (t==D_STRING) || (t==S_STRING) ) return "string";
   if( t==END_OF_FILE ) return "end-of-file";
-  
+
   throw runtime_error("Token type has no name.\n");
 
 }
 
+// content refers into the source buffer being lexed; it is only
+// valid for as long as that buffer is. Identifiers are interned as
+// they are lexed and carry their symbol; other tokens carry NONE.
 typedef struct
 {
-  string content;
+  string_view content;
+  symbol_table::symbol sym;
   token_type type;
   int line;
   int col;
   int offset;
 } token;
 
-class lexer
+// the complete text of a source file, held in memory so that
+// tokens can refer to it instead of copying it. Files are mapped
+// when possible; streams are read into a buffer.
+class source
 {
  private:
-  int line;
-  int col;
-  int offset;
+  string buffer;
+  const char *mapped;
+  std::size_t mapped_len;
+  string_view content;
 
- private:
-  // parser's dead ends may need to put tokens back into the lexing stream.
-  // it's up to the user to make what is "put back" is the same token
-  // that had last been extracted.
-  deque<token> q;
+  source( source const & ) = delete;
+  source & operator= ( source const & ) = delete;
 
-  // report that a character has been used
-  // updates stream, line, column, and offset
-  void
-    consume(istream &s  )
-  {
-    char c(s.get());
-    ++offset;
-    if( c=='\n' )
-      { ++line; col=0; }
-    else
-      { ++col; }
-  }
+ public:
+  source( istream &s )
+    : buffer( std::istreambuf_iterator<char>(s), std::istreambuf_iterator<char>() ),
+    mapped(nullptr), mapped_len(0), content(buffer)
+    {
+    }
+
+  source( string const &path )
+    : mapped(nullptr), mapped_len(0)
+    {
+      int fd = open( path.c_str(), O_RDONLY );
+      if( fd < 0 )
+	throw runtime_error("Could not open " + path + ".");
 
-  void 
-    eat_ws( istream &s )
+      struct stat st;
+      if( fstat(fd,&st)==0 && st.st_size > 0 )
+	{
+	  void *m = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	  if( m != MAP_FAILED )
+	    {
+	      mapped = static_cast<const char*>(m);
+	      mapped_len = st.st_size;
+	    }
+	}
+      close(fd);
+
+      if( mapped )
+	{
+	  content = string_view( mapped, mapped_len );
+	}
+      else
+	{
+	  // empty files, pipes and the like
+	  std::ifstream fin( path, std::ios::binary );
+	  buffer.assign( std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>() );
+	  content = buffer;
+	}
+    }
+
+  ~source()
+    {
+      if( mapped )
+	munmap( const_cast<char*>(mapped), mapped_len );
+    }
+
+  string_view
+    text() const
   {
-    char c = s.peek();
-    while( isspace(c) )
-      {
-	consume(s);
-	c = s.peek();
-      }
+    return content;
   }
+};
 
-  bool
-    isoperator( char c )
+// the token grammar as one dense automaton, so that a token is
+// found by table steps alone. Every state that ends a token knows
+// its type; states that end a keyword also know its symbol, so
+// keywords never need looking up. Longest match wins.
+class token_table
+{
+ public:
+  typedef compiled_dfa::index index;
+
+ private:
+  // what each token-ending state of the grammar stands for: a
+  // keyword's symbol, or -1 - the type of any other token
+  map<dfa::state,int> tags;
+  map<dfa::state,index> numbering;
+
+  static bool
+    id_char( int c )
   {
-    return c==':'
-      || c=='+'
-      || c=='-'
-      || c==','
-      || c=='('
-      || c==')'
-      || c=='['
-      || c==']'
-      || c==';';
+    return std::isalnum(c) || c=='_' || c=='-';
   }
 
-  string
-    lex_id( istream &s, stringstream &w  )
+  dfa
+    grammar( symbol_table const &symbols, std::size_t keywords )
   {
-    char c(s.peek());
-    while( isalpha(c) || isdigit(c) || c=='_' || c=='-' )
+    dfa d;
+    const dfa::state start( dfa::START );
+    const dfa::state reject( dfa::REJECT );
+    auto tag = [&]( dfa::state s, int t )
+      {
+	tags[s] = t;
+	d.accept_states.insert(s);
+      };
+
+    // identifiers, with the keywords spelled out in a trie whose
+    // states fall back on the plain identifier state
+    dfa::state id( d.add_state() );
+    tag( id, -1-ID );
+    vector<dfa::state> spelled;
+    for( std::size_t k=0; k<keywords; ++k )
+      {
+	string_view name( symbols.name(k) );
+	if( name.empty() || !std::isalpha( static_cast<unsigned char>(name[0]) )
+	    || !std::all_of( name.begin(), name.end(), []( char c ) { return id_char( static_cast<unsigned char>(c) ); } ) )
+	  continue;
+	dfa::state at(start);
+	for( char c : name )
+	  {
+	    dfa::state to( d.transition( at, c ) );
+	    if( to==reject )
+	      {
+		to = d.add_state();
+		d.transition.augment( at, c, to );
+		tag( to, -1-ID );
+		spelled.push_back(to);
+	      }
+	    at = to;
+	  }
+	tag( at, k );
+      }
+    for( int c=0; c<256; ++c )
       {
-	w << c;
-	consume(s);
-	c = s.peek();
+	if( !id_char(c) ) continue;
+	if( std::isalpha(c) && d.transition( start, c )==reject )
+	  d.transition.augment( start, c, id );
+	d.transition.augment( id, c, id );
+      }
+    for( dfa::state s : spelled )
+      {
+	// fill the gaps between the keyword letters in one pass
+	bool spelled_out[256] = {};
+	for( auto it = d.first_of(s); it != d.transition.t.end() && it->first.s==s; ++it )
+	  spelled_out[ static_cast<unsigned char>(it->first.c) ] = true;
+	auto hint = d.transition.first_of_state(s);
+	for( int c=0; c<256; ++c )
+	  if( id_char(c) && !spelled_out[c] )
+	    hint = d.transition.t.emplace_hint( hint, dfa::CFunc::Index( s, c ), id );
       }
-    return w.str();
-  }
 
-  string
-    lex_qstring( istream &s, stringstream &w )
-  {
-    char c(s.peek());
-    char toMatch(c);
-    if( !(c == '"' || c == '\'') )
+    // numbers
+    dfa::state integer( d.add_state() ), real( d.add_state() );
+    tag( integer, -1-INTEGER );
+    tag( real, -1-FLOAT );
+    for( char c='0'; c<='9'; ++c )
       {
-	throw runtime_error("Expected single or double quote.");
+	d.transition.augment( start, c, integer );
+	d.transition.augment( integer, c, integer );
+	d.transition.augment( real, c, real );
       }
-    
-    consume(s);
-    c = s.peek();
-    while( c != toMatch )
+    d.transition.augment( integer, '.', real );
+
+    for( char c : string(":+-,()[];") )
       {
-	w << c;
-	consume(s);
-	c = s.peek();
-	if( s.eof() )
-	  {
-	    throw runtime_error("Unterminated string.");
-	  }
+	dfa::state op( d.add_state() );
+	tag( op, -1-OP );
+	d.transition.augment( start, c, op );
       }
-    consume(s);
-    return w.str();
-  }
 
-  string
-    lex_number( istream &s, stringstream &w, bool & was_float )
-  {
-    was_float = false;
-    char c(s.peek());
-    while( isdigit(c) )
+    // comments run to the end of the line, strings to their quote
+    dfa::state comment( d.add_state() );
+    tag( comment, -1-COMMENT );
+    d.transition.augment( start, '!', comment );
+    for( int c=0; c<256; ++c )
+      if( c!='\n' )
+	d.transition.augment( comment, c, comment );
+
+    for( char q : string("\"'") )
       {
-	w << c;
-	consume(s);
-	c = s.peek();
+	dfa::state open( d.add_state() ), close( d.add_state() );
+	tag( close, -1-(q=='"'?D_STRING:S_STRING) );
+	d.transition.augment( start, q, open );
+	for( int c=0; c<256; ++c )
+	  d.transition.augment( open, c, c==q ? close : open );
       }
-    if( c=='.' )
+    return d;
+  }
+
+ public:
+  compiled_dfa table;
+  // by state number
+  vector<token_type> type_of;
+  vector<symbol_table::symbol> sym_of;
+
+  // the first keywords names in symbols become keywords
+  token_table( symbol_table const &symbols, std::size_t keywords )
+    : table( grammar( symbols, keywords ), &numbering ),
+    type_of( table.states, END_OF_FILE ),
+    sym_of( table.states, symbol_table::NONE )
+    {
+      for( auto const &t : tags )
+	{
+	  auto n = numbering.find( t.first );
+	  if( n==numbering.end() ) continue;
+	  index s( n->second / table.classes );
+	  if( t.second >= 0 )
+	    {
+	      type_of[s] = ID;
+	      sym_of[s] = t.second;
+	    }
+	  else
+	    type_of[s] = token_type( -1-t.second );
+	}
+      tags.clear();
+      numbering.clear();
+    }
+
+  // the table for the first keywords names in symbols, made once for
+  // each list of names and shared. Every assembler interns the same
+  // keywords and built-ins first, so they all share one; a list with
+  // user mnemonics makes another.
+  static std::shared_ptr<const token_table>
+    shared( symbol_table const &symbols, std::size_t keywords )
+  {
+    static std::mutex lock;
+    static std::map< string, std::shared_ptr<const token_table> > made;
+    string key;
+    for( std::size_t k=0; k<keywords; ++k )
       {
-	was_float = true;
-	consume(s);
-	w << c;
-	c = s.peek();
-	while( isdigit(c) )
-	  {
-	    w << c;
- 	    consume(s);
-	    c = s.peek();
-	  }
+	key += symbols.name(k);
+	key += '\0';
       }
-    return w.str();
+    std::lock_guard<std::mutex> hold( lock );
+    auto t = made.find( key );
+    if( t!=made.end() )
+      return t->second;
+    // only a few lists are in use at once
+    if( made.size() >= 16 )
+      made.clear();
+    return made[key] = std::make_shared<const token_table>( symbols, keywords );
   }
+};
+
+class lexer
+{
+ private:
+  const char *p;
+  const char *end;
+  int line;
+  const char *line_start;
+  const char *begin;
+
+  symbol_table &symbols;
+  // set when keywords() is called
+  std::shared_ptr<const token_table> tokens;
+
+  // parser's dead ends may need to look a few tokens ahead. Tokens
+  // that have been looked at but not consumed wait in this ring.
+  static const unsigned LOOKAHEAD = 4;
+  token q[LOOKAHEAD];
+  unsigned q_head;
+  unsigned q_size;
 
   void
-    remove_eofs()
+    eat_ws()
   {
-    deque<token> q_new;
-    for(std::size_t i=0;
-	i < q.size(); ++i )
+    while( p != end && isspace(static_cast<unsigned char>(*p)) )
       {
-	if( q[i].type != END_OF_FILE )
+	if( *p=='\n' )
 	  {
-	    q_new.push_back( q[i] );
+	    ++line;
+	    line_start = p+1;
 	  }
+	++p;
       }
-    q = q_new;
   }
-  
-  token 
-    extract_next_token( istream &s )
+
+  void
+    extract_next_token( token &t )
   {
-    eat_ws(s); // get rid of leading spaces.
-    char c = s.peek();
-    std::stringstream word("");
-    token t;
-    t.col = col;
+    eat_ws(); // get rid of leading spaces.
+    t.col = p - line_start;
     t.line = line;
-    t.offset = offset;
+    t.offset = p - begin;
+    t.sym = symbol_table::NONE;
 
-    if( s.eof() )
-      {
-	t.type = END_OF_FILE;	
-      }
-    else if( isdigit(c) )
+    if( p == end )
       {
-	bool was_float(false);
-	lex_number( s, word, was_float );
-	t.type = was_float?FLOAT:INTEGER;
+	t.type = END_OF_FILE;
+	t.content = string_view();
+	return;
       }
-    else if( isoperator(c) )
-      {
-	t.type = OP;
-	word << c;
-	consume(s);
-      }
-    else if( c=='!' )
+
+    // longest match: step until the dead state, remembering the
+    // last state that ended a token
+    const compiled_dfa &m( tokens->table );
+    const token_table::index *next( m.next );
+    token_table::index s( m.start ), found(0);
+    const char *q(p), *stop(nullptr);
+    while( q != end )
       {
-	while( c != '\n' )
+	s = next[ s + m.alphabet[ static_cast<unsigned char>(*q) ] ];
+	if( s==0 ) break;
+	++q;
+	if( s >= m.first_accept )
 	  {
-	    word.put(c);
-	    consume(s);
-	    c = s.peek();
+	    found = s;
+	    stop = q;
 	  }
-	t.type = COMMENT;
-	
       }
-    else if( isalpha(c) )
+    if( !stop )
       {
-	t.type = ID;
-	lex_id( s, word );       
-      }
-    else if( c=='"' )
-      {
-	t.type = D_STRING;
-	lex_qstring( s, word );
+	if( *p=='"' || *p=='\'' )
+	  throw runtime_error("Unterminated string.");
+	throw runtime_error("Invalid token.");
       }
-    else if( c=='\'' )
+
+    found /= m.classes;
+    t.type = tokens->type_of[found];
+    t.sym = tokens->sym_of[found];
+    const char *start(p);
+    p = stop;
+    if( t.type==D_STRING || t.type==S_STRING )
       {
-	t.type = S_STRING;
-	lex_qstring( s, word );
+	// without the quotes; strings may span lines
+	++start;
+	--stop;
+	for( const char *c=start; c!=stop; ++c )
+	  if( *c=='\n' )
+	    {
+	      ++line;
+	      line_start = c+1;
+	    }
       }
-    else
-      {
-	throw runtime_error("Invalid token.");
-      }
-    t.content = word.str();
-    return t;
+    t.content = string_view( start, stop-start );
+    if( t.type == ID && t.sym == symbol_table::NONE )
+      t.sym = symbols.intern( t.content );
   }
 
  public:
- 
- lexer()
-   : line(0),col(0),offset(0)
-    {
-    }
-  
+
+ lexer( symbol_table &symbols )
+   : p(nullptr),end(nullptr),line(0),line_start(nullptr),begin(nullptr),
+    symbols(symbols),q_head(0),q_size(0)
+    {}
+
+  // recognize every name interned so far as a keyword, carrying its
+  // symbol without a lookup. Call it again after interning more.
   void
-    reset()
+    keywords()
   {
-    q.clear();
-    line = 0;
-    col = 0;
-    offset = 0;
+    tokens = token_table::shared( symbols, symbols.size() );
   }
 
-
+  // start lexing text, which must outlive the tokens taken from it
   void
-    put_back( token t )
+    reset( string_view text = string_view() )
   {
-    q.push_back(t);
+    if( !tokens )
+      keywords();
+    begin = p = line_start = text.data();
+    end = text.data() + text.size();
+    line = 0;
+    q_head = 0;
+    q_size = 0;
   }
-    
-  void
-    look_ahead( istream &s, unsigned int n )
-    {
-      if( n==0 ) return;
-      
-      for(unsigned i=0; q.size()<n; ++i)
-	{
-	  q.push_back( extract_next_token(s) );
-	}
-    }
 
-  token
-    peek( istream &s, unsigned int where )
+  const token &
+    peek( unsigned int where )
   {
-    if( q.size() <= where )
-      look_ahead(s,where+1);
+    if( where >= LOOKAHEAD )
+      throw runtime_error("Lexer cannot look that far ahead.");
 
-    return q[where];
+    while( q_size <= where )
+      {
+	extract_next_token( q[(q_head+q_size)%LOOKAHEAD] );
+	++q_size;
+      }
+    return q[(q_head+where)%LOOKAHEAD];
   }
-    
+
 
   token
-    next_token( istream &s)
+    next_token()
   {
-    
-    if( q.size() > 0 )
+    if( q_size > 0 )
       {
-	token t = q.front();
-	q.pop_front();
+	token t = q[q_head];
+	q_head = (q_head+1)%LOOKAHEAD;
+	--q_size;
 	return t;
       }
     else
       {
-	return extract_next_token(s);
+	token t;
+	extract_next_token(t);
+	return t;
       }
-  }		     
+  }
 };
 
 #endif
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstdlib>
+
+#include "vm.h"
+#include "vm-default.h"
+#include "object.h"
+#include "linker.h"
+#include "strip.h"
+
+using std::string;
+using std::vector;
+
+// h64k-ld [-s] [-m words] [-o image.b64] object.o64 ...
+int
+main(int argc, char **argv )
+{
+  try
+    {
+      string out("a.b64");
+      bool strip(false);
+      unsigned words( VM_SIZE );
+      vector<object_file> objects;
+
+      for( int i=1; i<argc; ++i )
+	{
+	  string arg(argv[i]);
+	  if( arg=="-o" && i+1<argc )
+	    {
+	      out = argv[++i];
+	    }
+	  else if( arg=="-m" && i+1<argc )
+	    {
+	      words = std::atoi( argv[++i] );
+	    }
+	  else if( arg=="-s" )
+	    {
+	      strip = true;
+	    }
+	  else
+	    {
+	      objects.emplace_back();
+	      objects.back().load(arg);
+	    }
+	}
+
+      if( objects.empty() )
+	{
+	  std::cout << "usage: h64k-ld [-s] [-m words] [-o image.b64] object.o64 ...\n";
+	  return 1;
+	}
+
+      if( strip )
+	{
+	  // the whole program is here, so what it never reaches can go
+	  objects = vector<object_file>{ merge(objects) };
+	  write_report( std::cout, strip_unreachable( objects[0] ) );
+	}
+
+      with_segment_size( words, [&]( auto m )
+	{
+	  typedef typename decltype(m)::type machine_type;
+	  machine_type machine( create_default_vm<machine_type>() );
+	  machine.W() = 0;
+	  load( machine, link( objects, 0, machine.extensions.size(), machine_type::size ) );
+	  machine.IP() = 0;
+	  machine.SP() = machine_type::size-1;
+	  machine.serialize(out);
+	} );
+    }
+  catch( std::runtime_error &e )
+    {
+      std::cout << e.what() << "\n";
+      std::cout << "Link aborted.\n";
+      return 1;
+    }
+  return 0;
+}
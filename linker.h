@@ -0,0 +1,196 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+
+#include "vm.h"
+#include "object.h"
+
+using std::string;
+using std::vector;
+using std::unordered_map;
+using std::runtime_error;
+
+// objects placed one after another from address base, with
+// every relocation applied.
+typedef struct
+{
+  int base;
+  vector<int> code;
+  // where each label ended up
+  unordered_map<string,int> labels;
+  // the code given to each user mnemonic
+  unordered_map<string,int> mnemonics;
+} linked_program;
+
+// apply one relocation to a word of code
+inline int
+relocate( int word, object_file::reloc_kind kind, int value )
+{
+  switch( kind )
+    {
+    case object_file::rel_short:
+      if( value < 0 || value > 0xFFFF )
+	throw runtime_error("Address does not fit in a short argument.");
+      return (word & ~0xFFFF) | value;
+    case object_file::rel_opcode:
+      return (value << 16) | (word & 0xFFFF);
+    case object_file::rel_xaddr:
+      {
+	if( value < 0 || value >= (1<<13) )
+	  throw runtime_error("Address does not fit in an x-address.");
+	vm::instruction ins( vm::to_instruction(word) );
+	vm::conversion c( vm::convert(ins) );
+	c.x_args.a_loc = value;
+	return vm::int32( vm::assemble( ins.instr, c.s_arg ) );
+      }
+    }
+  throw runtime_error("Unknown relocation.");
+}
+
+// lay objects out in order from base, in a program segment of
+// words words. Mnemonics the objects leave unnumbered get codes from
+// first_code up, in order of first declaration, which is the order
+// their lambdas should be defined in.
+inline linked_program
+link( vector<object_file> const &objects, int base, int first_code, int words = VM_SIZE )
+{
+  linked_program p;
+  p.base = base;
+
+  vector<int> starts;
+  int at(base);
+  for( const object_file &o : objects )
+    {
+      starts.push_back(at);
+      at += o.code.size();
+    }
+  if( at > words )
+    throw runtime_error("Program does not fit in the program segment.");
+
+  // collect definitions
+  int next_code(first_code);
+  unordered_map<string,arg_form> forms;
+  for( unsigned i=0; i<objects.size(); ++i )
+    {
+      for( const object_file::symbol &s : objects[i].symbols )
+	{
+	  if( s.kind==object_file::sym_label )
+	    {
+	      if( !s.defined ) continue;
+	      if( !p.labels.emplace( s.name, starts[i]+s.value ).second )
+		throw runtime_error("Label " + s.name + " is defined more than once.");
+	      continue;
+	    }
+
+	  auto f = forms.find(s.name);
+	  if( f==forms.end() )
+	    {
+	      forms[s.name] = s.form;
+	      p.mnemonics[s.name] = (s.value<0)?next_code++:s.value;
+	    }
+	  else if( f->second != s.form
+		   || (s.value >= 0 && p.mnemonics[s.name] != s.value) )
+	    {
+	      throw runtime_error("Mnemonic " + s.name + " is declared differently in two objects.");
+	    }
+	}
+    }
+
+  // copy and patch
+  p.code.reserve( at-base );
+  for( unsigned i=0; i<objects.size(); ++i )
+    {
+      const object_file &o( objects[i] );
+      p.code.insert( p.code.end(), o.code.begin(), o.code.end() );
+      int *words = p.code.data() + (starts[i]-base);
+
+      for( const object_file::relocation &r : o.relocations )
+	{
+	  const object_file::symbol &s( o.symbols[r.sym] );
+	  unordered_map<string,int> &table( (s.kind==object_file::sym_label)?p.labels:p.mnemonics );
+	  auto v = table.find( s.name );
+	  if( v==table.end() )
+	    throw runtime_error("Undefined label " + s.name + ".");
+	  words[r.offset] = relocate( words[r.offset], r.kind, v->second );
+	}
+    }
+  return p;
+}
+
+// join objects into one, in order, as the linker would lay them out.
+// Labels one object imports and another defines become the same
+// symbol; so do mnemonics declared in more than one.
+inline object_file
+merge( vector<object_file> const &objects )
+{
+  object_file m;
+  unordered_map<string,unsigned> labels, mnems;
+
+  for( const object_file &o : objects )
+    {
+      int base( m.code.size() );
+      m.code.insert( m.code.end(), o.code.begin(), o.code.end() );
+
+      vector<unsigned> index( o.symbols.size() );
+      for( unsigned k=0; k<o.symbols.size(); ++k )
+	{
+	  object_file::symbol s( o.symbols[k] );
+	  if( s.kind==object_file::sym_label && s.defined )
+	    s.value += base;
+
+	  unordered_map<string,unsigned> &table( (s.kind==object_file::sym_label)?labels:mnems );
+	  auto it = table.find( s.name );
+	  if( it==table.end() )
+	    {
+	      index[k] = table[s.name] = m.symbols.size();
+	      m.symbols.push_back(s);
+	      continue;
+	    }
+
+	  object_file::symbol &t( m.symbols[it->second] );
+	  index[k] = it->second;
+	  if( s.kind==object_file::sym_label )
+	    {
+	      if( s.defined && t.defined )
+		throw runtime_error("Label " + s.name + " is defined more than once.");
+	      if( s.defined )
+		{
+		  t.defined = true;
+		  t.value = s.value;
+		}
+	    }
+	  else if( t.form != s.form || (s.value >= 0 && t.value != s.value) )
+	    {
+	      throw runtime_error("Mnemonic " + s.name + " is declared differently in two objects.");
+	    }
+	}
+
+      for( object_file::relocation r : o.relocations )
+	{
+	  r.offset += base;
+	  r.sym = index[r.sym];
+	  m.relocations.push_back(r);
+	}
+    }
+  return m;
+}
+
+// store a linked program at its base and leave W just past it
+template<unsigned Words, class Segment>
+void
+load( basic_vm<Words,Segment> &machine, linked_program const &p )
+{
+  if( p.base + p.code.size() > Words )
+    throw runtime_error("Program does not fit in the program segment.");
+  for( unsigned i=0; i<p.code.size(); ++i )
+    {
+      machine.program[p.base+i] = p.code[i];
+    }
+  machine.W() = (p.base + p.code.size()) & (Words-1);
+}
+
+#endif
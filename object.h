@@ -0,0 +1,201 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <cstdint>
+
+#include "vm.h"
+
+using std::string;
+using std::vector;
+using std::istream;
+using std::ostream;
+using std::runtime_error;
+
+// the assembled form of one source file: code that can be placed
+// anywhere in the program segment, the names it defines and the
+// names it needs from other objects.
+class object_file
+{
+ public:
+  typedef enum
+    {
+      sym_label, // a line label; value is its offset in code
+      sym_mnem   // a mnemonic; value is its code, or -1 if
+                 // the linker is to number it
+    } symbol_kind;
+
+  typedef struct
+  {
+    string name;
+    symbol_kind kind;
+    // false for labels this object uses but does not define
+    bool defined;
+    int value;
+    arg_form form;
+  } symbol;
+
+  typedef enum
+    {
+      rel_short,  // low 16 bits are the symbol's address
+      rel_xaddr,  // the 13 bit x-address location is the symbol's address
+      rel_opcode  // high 16 bits are the symbol's instruction code
+    } reloc_kind;
+
+  typedef struct
+  {
+    unsigned offset; // word of code to patch
+    reloc_kind kind;
+    unsigned sym;    // index into symbols
+  } relocation;
+
+  vector<int> code;
+  vector<symbol> symbols;
+  vector<relocation> relocations;
+
+ private:
+  static const unsigned VERSION = 1;
+
+  static void
+    put32( ostream &out, unsigned v )
+  {
+    out.put( v & 0xFF );
+    out.put( (v>>8) & 0xFF );
+    out.put( (v>>16) & 0xFF );
+    out.put( (v>>24) & 0xFF );
+  }
+
+  static unsigned
+    get32( istream &in )
+  {
+    unsigned char b[4];
+    if( !in.read( reinterpret_cast<char*>(b), 4 ) )
+      throw runtime_error("Truncated object file.");
+    return b[0] | (b[1]<<8) | (b[2]<<16) | (unsigned(b[3])<<24);
+  }
+
+  // a count of things at least size bytes each, which must fit in
+  // what is left of the stream, so a corrupt count cannot ask for
+  // more memory than the file could fill
+  static unsigned
+    get_count( istream &in, unsigned size )
+  {
+    unsigned n( get32(in) );
+    std::streampos at( in.tellg() );
+    if( at < 0 )
+      return n;
+    in.seekg( 0, std::ios::end );
+    std::streamoff left( in.tellg() - at );
+    in.seekg( at );
+    if( uint64_t(n)*size > uint64_t(left) )
+      throw runtime_error("Truncated object file.");
+    return n;
+  }
+
+  // a byte that must be at most last
+  static int
+    get_enum( istream &in, int last, const char *what )
+  {
+    int v( in.get() );
+    if( !in )
+      throw runtime_error("Truncated object file.");
+    if( v > last )
+      throw runtime_error(string("Unknown ") + what + " in object file.");
+    return v;
+  }
+
+ public:
+  void
+    write( ostream &out ) const
+  {
+    out.write( "H64O", 4 );
+    put32( out, VERSION );
+
+    put32( out, code.size() );
+    for( int w : code )
+      put32( out, w );
+
+    put32( out, symbols.size() );
+    for( const symbol &s : symbols )
+      {
+	out.put( s.kind );
+	out.put( s.defined );
+	out.put( s.form );
+	put32( out, s.value );
+	put32( out, s.name.size() );
+	out.write( s.name.data(), s.name.size() );
+      }
+
+    put32( out, relocations.size() );
+    for( const relocation &r : relocations )
+      {
+	put32( out, r.offset );
+	out.put( r.kind );
+	put32( out, r.sym );
+      }
+  }
+
+  void
+    read( istream &in )
+  {
+    char magic[4];
+    if( !in.read( magic, 4 ) || string(magic,4) != "H64O" )
+      throw runtime_error("Not an object file.");
+    if( get32(in) != VERSION )
+      throw runtime_error("Unsupported object file version.");
+
+    code.resize( get_count( in, 4 ) );
+    for( int &w : code )
+      w = get32(in);
+
+    // kind, defined and form, value, length of the name
+    symbols.resize( get_count( in, 3+4+4 ) );
+    for( symbol &s : symbols )
+      {
+	s.kind = static_cast<symbol_kind>( get_enum( in, sym_mnem, "symbol kind" ) );
+	s.defined = in.get() != 0;
+	s.form = static_cast<arg_form>( get_enum( in, form_scalar, "instruction form" ) );
+	s.value = get32(in);
+	s.name.resize( get_count( in, 1 ) );
+	in.read( &s.name[0], s.name.size() );
+      }
+
+    // offset, kind, symbol
+    relocations.resize( get_count( in, 4+1+4 ) );
+    for( relocation &r : relocations )
+      {
+	r.offset = get32(in);
+	r.kind = static_cast<reloc_kind>( get_enum( in, rel_opcode, "relocation kind" ) );
+	r.sym = get32(in);
+	if( r.offset >= code.size() || r.sym >= symbols.size() )
+	  throw runtime_error("Corrupt relocation in object file.");
+      }
+    if( !in )
+      throw runtime_error("Truncated object file.");
+  }
+
+  void
+    save( string const &name ) const
+  {
+    std::ofstream fs( name, std::ios::binary );
+    write(fs);
+    fs.close();
+    if( !fs )
+      throw runtime_error("Could not write " + name + ".");
+  }
+
+  void
+    load( string const &name )
+  {
+    std::ifstream fs( name, std::ios::binary );
+    if( !fs )
+      throw runtime_error("Could not open " + name + ".");
+    read(fs);
+  }
+};
+
+#endif
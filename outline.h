@@ -0,0 +1,217 @@
+#ifndef OUTLINE_H
+#define OUTLINE_H
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include "vm.h"
+#include "vm-default.h"
+#include "ir.h"
+
+using std::vector;
+using std::unordered_map;
+
+// shrinks code by turning runs of words that occur more than once
+// into lambdas: each run becomes the body of a lambda-l defined at
+// the start of the program, and every occurrence one word calling
+// the mnemonic it defines.
+//
+// A lambda of L words called from k places costs k calls plus L+2
+// words of definition (lambda-l and return), so a run is only
+// outlined when that is less than the k*L words it replaces. The
+// most profitable run goes first and the search starts again, so
+// calls can end up in later bodies too.
+//
+// Calling a lambda overwrites A and keeps the return address on the
+// stack, so the code must not use A and a run must leave the stack
+// as it found it. Runs hold no jumps, and nothing jumps into one.
+class outliner
+{
+  // the longest run looked for
+  static const unsigned longest = 24;
+
+  machine_code &code;
+  unsigned first_user;
+  vector<vector<int> > bodies;
+
+  static unsigned short op( int word ) { return (word >> 16) & 0xFFFF; }
+
+  // words that may not be part of a run
+  bool
+    fixed( unsigned i ) const
+  {
+    unsigned short c( op( code.words[i] ) );
+    return code.target[i] >= 0 || c==builtin_code("halt")
+      || c==builtin_code("j-e") || c==builtin_code("jmp-l");
+  }
+
+  static int
+    stack_effect( int word )
+  {
+    unsigned short c( op(word) );
+    if( c==builtin_code("push-l") || c==builtin_code("push-a") ) return 1;
+    if( c==builtin_code("pop-a") ) return -1;
+    return 0;
+  }
+
+  // how many words from i could go in a run starting there
+  vector<unsigned>
+    reach() const
+  {
+    unsigned n( code.words.size() );
+    vector<bool> labelled( n+1, false );
+    for( int l : code.label_at )
+      if( l >= 0 ) labelled[l] = true;
+    vector<unsigned> r( n+1, 0 );
+    for( unsigned i=n; i-- > 0; )
+      {
+	if( fixed(i) )
+	  r[i] = 0;
+	else
+	  r[i] = labelled[i+1] ? 1 : 1 + r[i+1];
+      }
+    return r;
+  }
+
+  bool
+    same( unsigned a, unsigned b, unsigned len ) const
+  {
+    for( unsigned j=0; j<len; ++j )
+      if( code.words[a+j] != code.words[b+j] ) return false;
+    return true;
+  }
+
+  // the most profitable run: its first occurrence, its length, and
+  // where it occurs. Returns false if none saves a word.
+  bool
+    best( unsigned &length, vector<unsigned> &at ) const
+  {
+    unsigned n( code.words.size() );
+    vector<unsigned> r( reach() );
+    // runs by hash; a start whose run has another length is a clash
+    // and is left out
+    typedef struct
+    {
+      unsigned length;
+      vector<unsigned> starts;
+    } run;
+    unordered_map<uint64_t,run> runs;
+    for( unsigned i=0; i<n; ++i )
+      {
+	uint64_t h( 0 );
+	int depth(0), low(0);
+	for( unsigned len=1; len<=r[i] && len<=longest; ++len )
+	  {
+	    int w( code.words[i+len-1] );
+	    h = (h + uint32_t(w)) * 0x9E3779B97F4A7C15ull + len;
+	    depth += stack_effect(w);
+	    low = std::min( low, depth );
+	    if( low < 0 ) break;
+	    if( len < 2 || depth != 0 ) continue;
+	    run &found( runs[h] );
+	    if( found.starts.empty() ) found.length = len;
+	    if( found.length==len ) found.starts.push_back(i);
+	  }
+      }
+
+    int saving(0);
+    for( auto const &found : runs )
+      {
+	vector<unsigned> const &starts( found.second.starts );
+	if( starts.size() < 2 ) continue;
+	unsigned s( starts[0] ), len( found.second.length );
+	vector<unsigned> taken;
+	unsigned end(0);
+	for( unsigned t : starts )
+	  {
+	    if( t < end || !same( s, t, len ) ) continue;
+	    taken.push_back(t);
+	    end = t + len;
+	  }
+	int k( taken.size() );
+	int gain( k*int(len) - (k + int(len) + 2) );
+	if( gain > saving || (gain==saving && gain>0 && len>length) )
+	  {
+	    saving = gain;
+	    length = len;
+	    at = taken;
+	  }
+      }
+    return saving > 0;
+  }
+
+  // replace each run of length len starting in at with a call
+  void
+    replace( unsigned len, vector<unsigned> const &at )
+  {
+    unsigned short user( first_user + bodies.size() );
+    bodies.emplace_back( code.words.begin()+at[0], code.words.begin()+at[0]+len );
+
+    unsigned n( code.words.size() );
+    vector<int> moved( n+1 );
+    machine_code out;
+    unsigned next(0);
+    for( unsigned i=0; i<n; )
+      {
+	moved[i] = out.words.size();
+	if( next<at.size() && at[next]==i )
+	  {
+	    out.add( vm::assemble(user) );
+	    i += len;
+	    ++next;
+	  }
+	else
+	  {
+	    out.words.push_back( code.words[i] );
+	    out.target.push_back( code.target[i] );
+	    ++i;
+	  }
+      }
+    moved[n] = out.words.size();
+    out.label_at = code.label_at;
+    for( int &l : out.label_at )
+      if( l >= 0 ) l = moved[l];
+    code = out;
+  }
+
+ public:
+  // lambdas will be numbered from first_user, the number of
+  // instructions the machine has before any are defined
+  outliner( machine_code &code, unsigned first_user )
+    : code(code), first_user(first_user)
+  {}
+
+  // outline all it is worth outlining, then put the lambdas'
+  // definitions in front of the code; returns how many there are
+  unsigned
+    run()
+  {
+    unsigned length(0);
+    vector<unsigned> at;
+    while( best( length, at ) )
+      {
+	replace( length, at );
+	length = 0;
+      }
+
+    machine_code defs;
+    for( vector<int> const &body : bodies )
+      {
+	defs.add( vm::assemble( builtin_code("lambda-l"), (unsigned short)(body.size()+1) ) );
+	defs.words.insert( defs.words.end(), body.begin(), body.end() );
+	defs.target.resize( defs.words.size(), -1 );
+	defs.add( vm::assemble( builtin_code("return") ) );
+      }
+    unsigned shift( defs.words.size() );
+    defs.words.insert( defs.words.end(), code.words.begin(), code.words.end() );
+    defs.target.insert( defs.target.end(), code.target.begin(), code.target.end() );
+    defs.label_at = code.label_at;
+    for( int &l : defs.label_at )
+      if( l >= 0 ) l += shift;
+    code = defs;
+    return bodies.size();
+  }
+};
+
+#endif
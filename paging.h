@@ -0,0 +1,305 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+
+using std::vector;
+using std::string;
+using std::unique_ptr;
+using std::runtime_error;
+
+// a segment of Words words of which only some pages are in memory.
+// Pages are made on first touch, either zero or read from the image
+// the machine was loaded from. Past the resident limit the least
+// recently faulted page is written to a swap file and dropped.
+//
+// A direct-mapped software TLB answers most accesses without looking
+// at the page table. References handed out stay valid for a few
+// accesses after they are taken, which is as long as any instruction
+// holds them: pages in the TLB, the last few pages faulted and the
+// page holding the registers are never evicted.
+template<unsigned Words, unsigned PageWords = 1024>
+class paged_segment
+{
+  static_assert( (PageWords & (PageWords-1))==0 && PageWords <= Words,
+		 "pages must be a power of two no bigger than the segment" );
+
+ public:
+  static constexpr unsigned page_words = PageWords;
+  static constexpr unsigned pages = Words/PageWords;
+
+  // counted since the segment was made
+  unsigned long faults;
+  unsigned long evictions;
+
+ private:
+  static constexpr unsigned tlb_size = 16;
+  static constexpr unsigned recent_size = 4;
+
+  typedef struct
+  {
+    unsigned page;
+    int *data;
+  } tlb_entry;
+
+  typedef struct
+  {
+    unique_ptr<int[]> data;
+    // where the page was last written to swap, or -1
+    long swapped;
+    // neighbours in the list of resident pages, or pages
+    unsigned older, newer;
+  } page_slot;
+
+  struct file_closer
+  {
+    void operator()( std::FILE *f ) const { std::fclose(f); }
+  };
+
+  vector<page_slot> table;
+  tlb_entry tlb[tlb_size];
+  unsigned recent[recent_size];
+  unsigned next_recent;
+  // resident pages, least recently faulted first
+  unsigned oldest, newest;
+  unsigned resident;
+  unsigned limit;
+
+  // the image pages are read from; word i is at first + i*stride
+  // bytes, and the image holds extent words
+  unique_ptr<std::ifstream> image;
+  std::streamoff first;
+  unsigned stride;
+  unsigned extent;
+
+  unique_ptr<std::FILE,file_closer> swap;
+  long swap_end;
+
+  void
+    invalidate()
+  {
+    for( tlb_entry &e : tlb )
+      {
+	e.page = pages;
+	e.data = nullptr;
+      }
+    for( unsigned &r : recent ) r = pages;
+  }
+
+  bool
+    pinned( unsigned p ) const
+  {
+    if( p==0 ) return true;
+    for( const tlb_entry &e : tlb )
+      if( e.page==p ) return true;
+    for( unsigned r : recent )
+      if( r==p ) return true;
+    return false;
+  }
+
+  void
+    unlink( unsigned p )
+  {
+    page_slot &s( table[p] );
+    (s.older==pages ? oldest : table[s.older].newer) = s.newer;
+    (s.newer==pages ? newest : table[s.newer].older) = s.older;
+  }
+
+  void
+    append( unsigned p )
+  {
+    page_slot &s( table[p] );
+    s.older = newest;
+    s.newer = pages;
+    (newest==pages ? oldest : table[newest].newer) = p;
+    newest = p;
+  }
+
+  // the least recently faulted page that is not pinned; only the few
+  // pinned pages are passed over, so this does not grow with the
+  // number resident
+  void
+    evict_one()
+  {
+    unsigned victim( oldest );
+    while( victim!=pages && pinned(victim) )
+      victim = table[victim].newer;
+    if( victim==pages )
+      return;
+
+    page_slot &s( table[victim] );
+    if( !swap )
+      {
+	swap.reset( std::tmpfile() );
+	if( !swap )
+	  throw runtime_error("Could not make a swap file for paged memory.");
+      }
+    if( s.swapped < 0 )
+      {
+	s.swapped = swap_end;
+	swap_end += PageWords*sizeof(int);
+      }
+    std::fseek( swap.get(), s.swapped, SEEK_SET );
+    if( std::fwrite( s.data.get(), sizeof(int), PageWords, swap.get() ) != PageWords )
+      throw runtime_error("Could not write a page to swap.");
+    s.data.reset();
+    unlink( victim );
+    --resident;
+    ++evictions;
+  }
+
+  void
+    fill( unsigned p, int *data )
+  {
+    page_slot &s( table[p] );
+    if( s.swapped >= 0 )
+      {
+	std::fseek( swap.get(), s.swapped, SEEK_SET );
+	if( std::fread( data, sizeof(int), PageWords, swap.get() ) != PageWords )
+	  throw runtime_error("Could not read a page back from swap.");
+	return;
+      }
+    std::fill( data, data+PageWords, 0 );
+    unsigned start( p*PageWords );
+    if( !image || start >= extent )
+      return;
+
+    // the image interleaves segments, so read the page's stretch
+    // of it and pick out this segment's words
+    unsigned n( std::min( PageWords, extent-start ) );
+    vector<char> buf( n*stride );
+    image->clear();
+    image->seekg( first + std::streamoff(start)*stride );
+    image->read( buf.data(), buf.size() );
+    // the last word of a stretch has no neighbour after it
+    std::streamsize read( image->gcount() );
+    unsigned got( read >= 4 ? (read-4)/stride + 1 : 0 );
+    for( unsigned i=0; i<got; ++i )
+      {
+	const unsigned char *b( reinterpret_cast<const unsigned char*>( &buf[i*stride] ) );
+	data[i] = b[0] | (b[1]<<8) | (b[2]<<16) | (unsigned(b[3])<<24);
+      }
+  }
+
+  int *
+    fault( unsigned p )
+  {
+    page_slot &s( table[p] );
+    if( s.data )
+      unlink( p );
+    else
+      {
+	while( resident >= limit && resident > 0 )
+	  {
+	    unsigned before(resident);
+	    evict_one();
+	    if( resident==before ) break;
+	  }
+	s.data.reset( new int[PageWords] );
+	fill( p, s.data.get() );
+	++resident;
+	++faults;
+      }
+    append( p );
+    recent[ next_recent++ % recent_size ] = p;
+    return s.data.get();
+  }
+
+ public:
+  // the fewest pages a segment can keep resident
+  static constexpr unsigned min_resident = tlb_size + recent_size + 2;
+
+  explicit paged_segment( unsigned words = Words )
+    : faults(0), evictions(0), table(pages), next_recent(0),
+      oldest(pages), newest(pages), resident(0), limit(256), first(0), stride(4), extent(0), swap_end(0)
+  {
+    for( page_slot &s : table )
+      {
+	s.swapped = -1;
+	s.older = s.newer = pages;
+      }
+    invalidate();
+  }
+
+  paged_segment( paged_segment && ) = default;
+  paged_segment & operator=( paged_segment && ) = default;
+
+  unsigned size() const { return Words; }
+  unsigned resident_pages() const { return resident; }
+
+  void
+    set_resident_limit( unsigned n )
+  {
+    limit = std::max( n, min_resident );
+  }
+
+  int &
+    operator[]( unsigned i )
+  {
+    i &= Words-1;
+    unsigned p( i / PageWords );
+    tlb_entry &e( tlb[ p % tlb_size ] );
+    if( e.page != p )
+      {
+	// choose any victim before this entry is overwritten, so the
+	// page it held stays put for this access
+	int *data( fault(p) );
+	e.page = p;
+	e.data = data;
+      }
+    return e.data[ i % PageWords ];
+  }
+
+  // forget every page, the image and the swap file
+  void
+    clear()
+  {
+    for( page_slot &s : table )
+      {
+	s.data.reset();
+	s.swapped = -1;
+      }
+    invalidate();
+    oldest = newest = pages;
+    resident = 0;
+    image.reset();
+    swap.reset();
+    swap_end = 0;
+    extent = 0;
+  }
+
+  // read pages from name on demand: word i is the 32 bit
+  // little-endian value at offset + i*step, for the first words words
+  void
+    attach( string const &name, std::streamoff offset, unsigned step, unsigned words )
+  {
+    clear();
+    image.reset( new std::ifstream( name, std::ios::binary ) );
+    if( !*image )
+      throw runtime_error("Could not open " + name + ".");
+    first = offset;
+    stride = step;
+    extent = std::min( words, Words );
+  }
+
+  // one past the last word that might not be zero
+  unsigned
+    used() const
+  {
+    unsigned top(0);
+    for( unsigned p=0; p<pages; ++p )
+      {
+	if( table[p].data || table[p].swapped >= 0 )
+	  top = (p+1)*PageWords;
+      }
+    return std::max( top, extent );
+  }
+};
+
+#endif
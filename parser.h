@@ -0,0 +1,405 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <string>
+#include <string_view>
+#include <sstream>
+#include <stdexcept>
+#include <cctype>
+#include <climits>
+
+#include "symbols.h"
+#include "ast.h"
+
+using std::string;
+using std::string_view;
+using std::stringstream;
+using std::runtime_error;
+
+// reads the language h64k-c compiles:
+//
+//   program   := statement*
+//   statement := name '=' expr ';'
+//              | 'print' item (',' item)* ';'
+//              | 'if' expr block ('else' (block | if-statement))?
+//              | 'while' expr block
+//              | 'halt' ';'
+//   block     := '{' statement* '}'
+//   item      := string | expr
+//   expr      := and ('|' and)*
+//   and       := compare ('&' compare)*
+//   compare   := sum (('=='|'!='|'<'|'>'|'<='|'>=') sum)?
+//   sum       := term (('+'|'-') term)*
+//   term      := unary (('*'|'/') unary)*
+//   unary     := '-' unary | integer | name | '(' expr ')'
+//
+// Values are 32 bit integers; comparisons give 1 or 0. A variable
+// comes into being when it is first assigned. Strings take \n, \t,
+// \\ and \" escapes, and # starts a comment to the end of the line.
+class parser
+{
+  typedef enum
+    {
+      t_end, t_name, t_integer, t_string, t_punct
+    } token_kind;
+
+  typedef struct
+  {
+    token_kind kind;
+    string_view text;
+    int line;
+  } token;
+
+  symbol_table &symbols;
+  ast *tree;
+
+  const char *p;
+  const char *end;
+  int line;
+  token ahead;
+
+  [[noreturn]] void
+    fail( string const &what, int at )
+  {
+    stringstream s;
+    s << "line " << at << ": " << what;
+    throw runtime_error(s.str());
+  }
+
+  [[noreturn]] void
+    fail( string const &what )
+  {
+    fail( what, ahead.line );
+  }
+
+  static bool
+    name_char( char c )
+  {
+    return std::isalnum( static_cast<unsigned char>(c) ) || c=='_';
+  }
+
+  // read the token after ahead into ahead
+  void
+    advance()
+  {
+    for( ;; )
+      {
+	while( p != end && std::isspace( static_cast<unsigned char>(*p) ) )
+	  {
+	    if( *p=='\n' ) ++line;
+	    ++p;
+	  }
+	if( p == end || *p != '#' ) break;
+	while( p != end && *p != '\n' ) ++p;
+      }
+
+    ahead.line = line;
+    const char *start(p);
+    if( p == end )
+      {
+	ahead.kind = t_end;
+	ahead.text = string_view();
+	return;
+      }
+
+    char c(*p);
+    if( std::isdigit( static_cast<unsigned char>(c) ) )
+      {
+	while( p != end && std::isdigit( static_cast<unsigned char>(*p) ) ) ++p;
+	ahead.kind = t_integer;
+      }
+    else if( std::isalpha( static_cast<unsigned char>(c) ) || c=='_' )
+      {
+	while( p != end && name_char(*p) ) ++p;
+	ahead.kind = t_name;
+      }
+    else if( c=='"' )
+      {
+	++p;
+	while( p != end && *p != '"' )
+	  {
+	    if( *p=='\\' && p+1 != end ) ++p;
+	    if( *p=='\n' ) ++line;
+	    ++p;
+	  }
+	if( p == end ) fail("Unterminated string.");
+	++p;
+	ahead.kind = t_string;
+      }
+    else
+      {
+	// two-character operators first
+	static const char *const pairs[] = { "==", "!=", "<=", ">=" };
+	ahead.kind = t_punct;
+	++p;
+	for( const char *two : pairs )
+	  {
+	    if( c==two[0] && p != end && *p==two[1] )
+	      {
+		++p;
+		break;
+	      }
+	  }
+	if( p-start==1 && string_view("=+-*/&|<>(){};,").find(c)==string_view::npos )
+	  fail( string("Unexpected '") + c + "'." );
+      }
+    ahead.text = string_view( start, p-start );
+  }
+
+  // ahead, as error messages show it
+  string
+    shown() const
+  {
+    return ahead.kind==t_end ? string("the end of the file") : "'" + string(ahead.text) + "'";
+  }
+
+  token
+    take()
+  {
+    token t(ahead);
+    advance();
+    return t;
+  }
+
+  bool
+    is( string_view punct ) const
+  {
+    return (ahead.kind==t_punct || ahead.kind==t_name) && ahead.text==punct;
+  }
+
+  void
+    expect( string_view punct )
+  {
+    if( !is(punct) )
+      fail( "Expected '" + string(punct) + "' but got " + shown() + "." );
+    advance();
+  }
+
+  node_id
+    primary()
+  {
+    if( is("-") )
+      {
+	int at( take().line );
+	return tree->add_op( n_unary, op_neg, at, primary() );
+      }
+    if( is("(") )
+      {
+	advance();
+	node_id e( expression() );
+	expect(")");
+	return e;
+      }
+    if( ahead.kind==t_integer )
+      {
+	long long v(0);
+	for( char d : ahead.text )
+	  {
+	    v = v*10 + (d-'0');
+	    if( v > UINT_MAX ) fail("Integer too big.");
+	  }
+	return tree->add( n_integer, take().line, int32_t( uint32_t(v) ) );
+      }
+    if( ahead.kind==t_name )
+      {
+	if( is("print") || is("if") || is("else") || is("while") || is("halt") )
+	  fail( "'" + string(ahead.text) + "' is a keyword." );
+	return tree->add( n_variable, ahead.line, symbols.intern( take().text ) );
+      }
+    fail( "Expected an expression but got " + shown() + "." );
+  }
+
+  node_id
+    term()
+  {
+    node_id e( primary() );
+    while( is("*") || is("/") )
+      {
+	token t( take() );
+	e = tree->add_op( n_binary, t.text=="*" ? op_mul : op_div, t.line, e, primary() );
+      }
+    return e;
+  }
+
+  node_id
+    sum()
+  {
+    node_id e( term() );
+    while( is("+") || is("-") )
+      {
+	token t( take() );
+	e = tree->add_op( n_binary, t.text=="+" ? op_add : op_sub, t.line, e, term() );
+      }
+    return e;
+  }
+
+  node_id
+    compare()
+  {
+    node_id e( sum() );
+    static const struct { const char *text; node_op op; } ops[] =
+      {
+	{ "==", op_eq }, { "!=", op_ne }, { "<", op_lt },
+	{ ">", op_gt }, { "<=", op_le }, { ">=", op_ge }
+      };
+    for( auto const &o : ops )
+      {
+	if( is(o.text) )
+	  {
+	    int at( take().line );
+	    return tree->add_op( n_binary, o.op, at, e, sum() );
+	  }
+      }
+    return e;
+  }
+
+  node_id
+    conjunction()
+  {
+    node_id e( compare() );
+    while( is("&") )
+      {
+	int at( take().line );
+	e = tree->add_op( n_binary, op_and, at, e, compare() );
+      }
+    return e;
+  }
+
+  node_id
+    expression()
+  {
+    node_id e( conjunction() );
+    while( is("|") )
+      {
+	int at( take().line );
+	e = tree->add_op( n_binary, op_or, at, e, conjunction() );
+      }
+    return e;
+  }
+
+  // the text of a string token, escapes undone
+  string
+    unescape( string_view quoted )
+  {
+    string s;
+    for( std::size_t i=1; i+1<quoted.size(); ++i )
+      {
+	char c( quoted[i] );
+	if( c=='\\' )
+	  {
+	    c = quoted[++i];
+	    if( c=='n' ) c = '\n';
+	    else if( c=='t' ) c = '\t';
+	    else if( c!='\\' && c!='"' ) fail("Unknown escape in string.");
+	  }
+	s += c;
+      }
+    return s;
+  }
+
+  node_id
+    block()
+  {
+    int at( ahead.line );
+    expect("{");
+    node_id first(NO_NODE), last(NO_NODE);
+    while( !is("}") )
+      {
+	if( ahead.kind==t_end ) fail("Unterminated block.", at);
+	node_id s( statement() );
+	if( last ) (*tree)[last].next = s; else first = s;
+	last = s;
+      }
+    advance();
+    return tree->add( n_block, at, 0, first );
+  }
+
+  node_id
+    statement()
+  {
+    int at( ahead.line );
+    if( is("print") )
+      {
+	advance();
+	node_id first(NO_NODE), last(NO_NODE);
+	for( ;; )
+	  {
+	    node_id item;
+	    if( ahead.kind==t_string )
+	      item = tree->add_string( unescape( take().text ), at );
+	    else
+	      item = expression();
+	    if( last ) (*tree)[last].next = item; else first = item;
+	    last = item;
+	    if( !is(",") ) break;
+	    advance();
+	  }
+	expect(";");
+	return tree->add( n_print, at, 0, first );
+      }
+    if( is("if") )
+      {
+	advance();
+	node_id cond( expression() );
+	node_id then( block() );
+	node_id otherwise(NO_NODE);
+	if( is("else") )
+	  {
+	    advance();
+	    otherwise = is("if") ? statement() : block();
+	  }
+	return tree->add( n_if, at, 0, cond, then, otherwise );
+      }
+    if( is("while") )
+      {
+	advance();
+	node_id cond( expression() );
+	return tree->add( n_while, at, 0, cond, block() );
+      }
+    if( is("halt") )
+      {
+	advance();
+	expect(";");
+	return tree->add( n_halt, at );
+      }
+    if( ahead.kind==t_name )
+      {
+	node_id target( primary() );
+	expect("=");
+	node_id value( expression() );
+	expect(";");
+	return tree->add( n_assign, at, (*tree)[target].value, value );
+      }
+    fail( "Expected a statement but got " + shown() + "." );
+  }
+
+ public:
+  parser( symbol_table &symbols )
+    : symbols(symbols), tree(nullptr), p(nullptr), end(nullptr), line(1)
+  {}
+
+  // the tree of a whole program; its root is a block
+  ast
+    parse( string_view text )
+  {
+    ast t;
+    tree = &t;
+    p = text.data();
+    end = text.data() + text.size();
+    line = 1;
+    advance();
+
+    node_id first(NO_NODE), last(NO_NODE);
+    while( ahead.kind != t_end )
+      {
+	node_id s( statement() );
+	if( last ) t[last].next = s; else first = s;
+	last = s;
+      }
+    t.root = t.add( n_block, 1, 0, first );
+    tree = nullptr;
+    return t;
+  }
+};
+
+#endif
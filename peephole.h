@@ -0,0 +1,163 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "vm.h"
+#include "vm-default.h"
+#include "object.h"
+#include "flow.h"
+
+using std::vector;
+using std::string;
+using std::ostream;
+
+// one rewrite made by the peephole pass: rule removed that many
+// words, starting at offset as it was when the rewrite was made.
+typedef struct
+{
+  unsigned offset;
+  const char *rule;
+  unsigned removed;
+} peephole_rewrite;
+
+typedef struct
+{
+  vector<peephole_rewrite> rewrites;
+  // why nothing was done, if nothing was
+  const char *skipped;
+} peephole_report;
+
+// remove instruction sequences that have no effect. Labelled
+// instructions are never removed or paired with the instruction
+// before them, and nothing is paired across a lambda body's ends.
+// Objects that use literal code addresses are left alone.
+inline peephole_report
+peephole( object_file &o )
+{
+  peephole_report report;
+  report.skipped = nullptr;
+
+  bool changed(true);
+  while( changed )
+    {
+      changed = false;
+      unsigned n( o.code.size() );
+      vector<reloc_info> rel( relocation_map(o) );
+
+      if( has_absolute_addresses( o, rel ) )
+	{
+	  report.skipped = "it uses literal code addresses";
+	  return report;
+	}
+
+      vector<bool> labelled( n+1, false );
+      for( const object_file::symbol &s : o.symbols )
+	{
+	  if( s.kind==object_file::sym_label && s.defined )
+	    labelled[s.value] = true;
+	}
+
+      // each word's innermost lambda body, by the body's start
+      vector<int> region( n, -1 );
+      for( unsigned l : lambda_sites( o, rel ) )
+	{
+	  for( unsigned j=l+1; j<lambda_end(o,l); ++j )
+	    region[j] = l+1;
+	}
+
+      auto is = [&]( unsigned i, unsigned short c )
+	{
+	  return is_builtin( o, rel, i, c );
+	};
+      // i and i+1 can be rewritten together
+      auto pair = [&]( unsigned i )
+	{
+	  return i+1<n && !labelled[i] && !labelled[i+1] && region[i]==region[i+1];
+	};
+
+      vector<bool> dead( n, false );
+      auto kill = [&]( unsigned i, unsigned count, const char *rule )
+	{
+	  for( unsigned j=0; j<count; ++j ) dead[i+j] = true;
+	  report.rewrites.push_back( peephole_rewrite{ i, rule, count } );
+	  changed = true;
+	};
+
+      for( unsigned i=0; i<n; ++i )
+	{
+	  int w( o.code[i] );
+	  if( is(i,op_jmp_l) && !labelled[i] && rel[i].label>=0 )
+	    {
+	      const object_file::symbol &t( o.symbols[rel[i].label] );
+	      if( t.defined && t.value==int(i+1) && region[i]==(i+1<n?region[i+1]:-1) )
+		kill( i, 1, "jump to the next instruction" );
+	    }
+	  else if( pair(i) && (is(i,op_inc_x) || is(i,op_dec_x))
+		   && is(i+1, word_op(w)==op_inc_x?op_dec_x:op_inc_x)
+		   && word_arg(w)==word_arg(o.code[i+1]) && rel[i].label==rel[i+1].label )
+	    {
+	      vm::conversion a;
+	      a.s_arg = word_arg(w);
+	      // only a plain register without a job: incrementing IP or
+	      // HALTED does something, and an address that is not a
+	      // register may be code, or where the other one points
+	      if( a.x_args.a_mod==mod_rv && a.x_args.a_loc>=first_general_register )
+		{
+		  kill( i, 2, "increment and decrement cancel" );
+		  ++i;
+		}
+	    }
+	  else if( pair(i) && is(i,op_cmp_r) && is(i+1,op_cmp_r) )
+	    {
+	      kill( i, 1, "compare overwritten by compare" );
+	    }
+	  else if( pair(i) && is(i,op_push_a) && is(i+1,op_pop_a)
+		   && word_arg(w)==word_arg(o.code[i+1]) && word_arg(w)>=first_general_register )
+	    {
+	      kill( i, 2, "push and pop of the same address" );
+	      ++i;
+	    }
+	}
+
+      if( changed )
+	remove_words( o, dead );
+    }
+  return report;
+}
+
+// one line per rule used, with the words it saved, or why the
+// object was left alone
+inline void
+write_report( ostream &out, string const &name, peephole_report const &report )
+{
+  if( report.skipped )
+    {
+      out << name << ": peephole left it alone, " << report.skipped << "\n";
+      return;
+    }
+  vector<const char*> rules;
+  vector<unsigned> saved;
+  unsigned total(0);
+  for( const peephole_rewrite &r : report.rewrites )
+    {
+      unsigned k(0);
+      while( k<rules.size() && rules[k]!=r.rule ) ++k;
+      if( k==rules.size() )
+	{
+	  rules.push_back(r.rule);
+	  saved.push_back(0);
+	}
+      saved[k] += r.removed;
+      total += r.removed;
+    }
+  for( unsigned k=0; k<rules.size(); ++k )
+    {
+      out << name << ": " << rules[k] << ": " << saved[k] << " word(s)\n";
+    }
+  out << name << ": peephole saved " << total << " word(s)\n";
+}
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using std::string;
+using std::vector;
+
+// the host's hardware counters, for this process in user mode only,
+// read through perf_event_open. The counters that open form one group,
+// so they are started, stopped and read together. Counters the
+// kernel, the hardware or the sandbox will not give are left out and
+// read as absent; if none open, nothing is counted and why is kept.
+class perf_counters
+{
+ public:
+  typedef enum
+    {
+      cycles, instructions, branch_misses, cache_misses, kinds
+    } kind;
+
+  static const char *
+    name( kind k )
+  {
+    static const char *const names[kinds] =
+      { "cycles", "instructions", "branch-misses", "cache-misses" };
+    return names[k];
+  }
+
+  // one reading of every counter; absent ones are left at 0
+  typedef struct
+  {
+    uint64_t value[kinds];
+  } reading;
+
+ private:
+  int fd[kinds];
+  int leader;
+  // the position of each open counter in a group read
+  int slot[kinds];
+  int open_count;
+  string failure;
+
+ public:
+  perf_counters()
+    : leader(-1), open_count(0)
+  {
+    for( int k=0; k<kinds; ++k )
+      {
+	fd[k] = -1;
+	slot[k] = -1;
+      }
+#ifdef __linux__
+    static const uint64_t configs[kinds] =
+      {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES
+      };
+    for( int k=0; k<kinds; ++k )
+      {
+	perf_event_attr a;
+	std::memset( &a, 0, sizeof a );
+	a.size = sizeof a;
+	a.type = PERF_TYPE_HARDWARE;
+	a.config = configs[k];
+	a.disabled = leader<0;
+	a.exclude_kernel = 1;
+	a.exclude_hv = 1;
+	a.read_format = PERF_FORMAT_GROUP;
+	fd[k] = syscall( __NR_perf_event_open, &a, 0, -1, leader, 0 );
+	if( fd[k] < 0 )
+	  {
+	    if( failure.empty() )
+	      failure = string(name(kind(k))) + ": " + std::strerror(errno);
+	    continue;
+	  }
+	if( leader < 0 ) leader = fd[k];
+	slot[k] = open_count++;
+      }
+#else
+    failure = "perf_event_open is Linux only";
+#endif
+  }
+
+  ~perf_counters()
+  {
+#ifdef __linux__
+    for( int k=0; k<kinds; ++k )
+      if( fd[k] >= 0 ) close( fd[k] );
+#endif
+  }
+
+  perf_counters( perf_counters const & ) = delete;
+  perf_counters & operator=( perf_counters const & ) = delete;
+
+  bool available() const { return open_count > 0; }
+  bool counts( kind k ) const { return slot[k] >= 0; }
+
+  // why a counter, or all of them, could not be had
+  string const & why() const { return failure; }
+
+  void
+    start()
+  {
+#ifdef __linux__
+    if( leader < 0 ) return;
+    ioctl( leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP );
+    ioctl( leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP );
+#endif
+  }
+
+  void
+    stop()
+  {
+#ifdef __linux__
+    if( leader < 0 ) return;
+    ioctl( leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP );
+#endif
+  }
+
+  // the counts so far, running or not
+  reading
+    read() const
+  {
+    reading r;
+    for( int k=0; k<kinds; ++k ) r.value[k] = 0;
+#ifdef __linux__
+    if( leader < 0 ) return r;
+    uint64_t buf[1+kinds];
+    if( ::read( leader, buf, sizeof buf ) < ssize_t( sizeof(uint64_t) ) )
+      return r;
+    for( int k=0; k<kinds; ++k )
+      if( slot[k] >= 0 && uint64_t(slot[k]) < buf[0] )
+	r.value[k] = buf[ 1+slot[k] ];
+#endif
+    return r;
+  }
+};
+
+// b - a, counter by counter
+inline perf_counters::reading
+operator-( perf_counters::reading const &b, perf_counters::reading const &a )
+{
+  perf_counters::reading d;
+  for( int k=0; k<perf_counters::kinds; ++k )
+    d.value[k] = b.value[k] - a.value[k];
+  return d;
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef STRIP_H
+#define STRIP_H
+
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "vm.h"
+#include "vm-default.h"
+#include "object.h"
+#include "flow.h"
+
+using std::vector;
+using std::string;
+using std::ostream;
+
+typedef struct
+{
+  unsigned words_before;
+  unsigned words_after;
+  // mnemonics whose lambdas were removed
+  vector<string> lambdas;
+  // why nothing was done, if nothing was
+  const char *skipped;
+} strip_report;
+
+// remove the code a whole program can never execute, starting from
+// its first word. The control-flow graph follows jmp-l, j-e, call-l
+// and j-x targets, falls through everything else, and stops at
+// return, return-l, return-x and halt. Labels used as data (push-l
+// label, code:label) are taken to be reachable, since return and
+// call-x can jump to them.
+//
+// The k-th lambda-l defines the k-th mnemonic the linker numbers, so
+// a lambda's body is only reachable through uses of its mnemonic.
+// Lambdas that are never used are removed with their mnemonics,
+// which keeps the two numberings in step.
+inline strip_report
+strip_unreachable( object_file &o )
+{
+  strip_report report;
+  report.words_before = report.words_after = o.code.size();
+  report.skipped = nullptr;
+
+  vector<reloc_info> rel( relocation_map(o) );
+  if( has_absolute_addresses( o, rel ) )
+    {
+      report.skipped = "it uses literal code addresses";
+      return report;
+    }
+
+  unsigned n( o.code.size() );
+
+  // which lambda belongs to which mnemonic
+  vector<unsigned> sites( lambda_sites( o, rel ) );
+  vector<unsigned> numbered;
+  bool fixed_codes(false);
+  for( unsigned k=0; k<o.symbols.size(); ++k )
+    {
+      if( o.symbols[k].kind!=object_file::sym_mnem ) continue;
+      if( o.symbols[k].value<0 )
+	numbered.push_back(k);
+      else
+	fixed_codes = true;
+    }
+  // mnemonics with codes of their own make the pairing a guess;
+  // then every lambda is kept.
+  bool paired( !fixed_codes && sites.size()==numbered.size() );
+  vector<int> site_of( o.symbols.size(), -1 );
+  if( paired )
+    {
+      for( unsigned k=0; k<sites.size(); ++k )
+	site_of[ numbered[k] ] = sites[k];
+    }
+
+  auto target = [&]( unsigned i ) -> int
+    {
+      if( rel[i].label<0 ) return -1;
+      const object_file::symbol &s( o.symbols[rel[i].label] );
+      if( !s.defined )
+	throw runtime_error("Cannot strip a program that uses undefined label " + s.name + ".");
+      return s.value;
+    };
+
+  vector<bool> live( n, false );
+  vector<bool> used( o.symbols.size(), false );
+  vector<unsigned> work;
+  auto reach = [&]( int i )
+    {
+      if( i>=0 && unsigned(i)<n && !live[i] )
+	{
+	  live[i] = true;
+	  work.push_back(i);
+	}
+    };
+
+  reach(0);
+  while( !work.empty() )
+    {
+      unsigned i( work.back() );
+      work.pop_back();
+
+      if( rel[i].opcode )
+	{
+	  int m( rel[i].mnem );
+	  if( !used[m] && site_of[m]>=0 )
+	    {
+	      reach( site_of[m] );
+	      reach( site_of[m]+1 );
+	    }
+	  used[m] = true;
+	  reach( i+1 );
+	  continue;
+	}
+
+      unsigned short c( word_op(o.code[i]) );
+      if( c==op_jmp_l )
+	reach( target(i) );
+      else if( c==op_j_e || c==op_call_l )
+	{
+	  reach( target(i) );
+	  reach( i+1 );
+	}
+      else if( c==op_return || c==op_return_l || c==op_return_x || c==op_halt )
+	;
+      else if( c==op_j_x )
+	reach( target(i) );
+      else if( c==op_lambda_l && rel[i].label<0 )
+	{
+	  reach( lambda_end(o,i) );
+	  if( !paired )
+	    reach( i+1 );
+	}
+      else
+	{
+	  // anything else referring to a label takes its address
+	  reach( target(i) );
+	  reach( i+1 );
+	}
+    }
+
+  // a lambda that is never used goes, definition and all, unless
+  // something jumps into its body
+  vector<bool> dropped( o.symbols.size(), false );
+  if( paired )
+    {
+      for( unsigned k=0; k<sites.size(); ++k )
+	{
+	  unsigned m( numbered[k] );
+	  if( used[m] ) continue;
+	  bool entered(false);
+	  for( unsigned j=sites[k]+1; j<lambda_end(o,sites[k]); ++j )
+	    entered = entered || live[j];
+	  if( entered ) continue;
+	  live[ sites[k] ] = false;
+	  dropped[m] = true;
+	  report.lambdas.push_back( o.symbols[m].name );
+	}
+    }
+
+  vector<bool> dead( n );
+  for( unsigned i=0; i<n; ++i )
+    dead[i] = !live[i];
+  remove_words( o, dead );
+
+  // forget the dropped mnemonics; nothing refers to them now
+  vector<unsigned> index( o.symbols.size() );
+  vector<object_file::symbol> kept;
+  for( unsigned k=0; k<o.symbols.size(); ++k )
+    {
+      index[k] = kept.size();
+      if( !dropped[k] ) kept.push_back( o.symbols[k] );
+    }
+  o.symbols.swap(kept);
+  for( object_file::relocation &r : o.relocations )
+    r.sym = index[r.sym];
+
+  report.words_after = o.code.size();
+  return report;
+}
+
+inline void
+write_report( ostream &out, strip_report const &report )
+{
+  if( report.skipped )
+    {
+      out << "strip: left alone, " << report.skipped << "\n";
+      return;
+    }
+  for( string const &l : report.lambdas )
+    {
+      out << "strip: removed unused lambda " << l << "\n";
+    }
+  out << "strip: " << report.words_before << " word(s) down to "
+      << report.words_after << "\n";
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+
+using std::string;
+using std::string_view;
+using std::deque;
+using std::unordered_map;
+
+// gives every distinct identifier a small integer so that later
+// stages can index arrays instead of comparing strings.
+class symbol_table
+{
+ public:
+  typedef int symbol;
+  static constexpr symbol NONE = -1;
+
+ private:
+  // deque: growing it never moves the strings the keys refer to.
+  deque<string> names;
+  unordered_map<string_view,symbol> ids;
+
+ public:
+  symbol
+    intern( string_view name )
+  {
+    auto it = ids.find(name);
+    if( it != ids.end() )
+      return it->second;
+
+    names.emplace_back(name);
+    symbol s = names.size()-1;
+    ids.emplace( string_view(names.back()), s );
+    return s;
+  }
+
+  // NONE if the name has never been interned
+  symbol
+    find( string_view name ) const
+  {
+    auto it = ids.find(name);
+    return (it==ids.end())?NONE:it->second;
+  }
+
+  string_view
+    name( symbol s ) const
+  {
+    return names[s];
+  }
+
+  std::size_t
+    size() const
+  {
+    return names.size();
+  }
+};
+
+#endif
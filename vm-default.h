@@ -2,71 +2,81 @@
 #define VM_DEFAULT_H
 
 #include <sstream>
+#include <stdexcept>
 #include <ncurses.h>
 #include "vm.h"
 
 using std::stringstream;
 
-void RESET ( vm &machine, vm::instruction instr )
+template<class M>
+void RESET( M &machine, vm::instruction instr )
 {
-  for( int i=0; i<VM_SIZE; ++i)
-    {
-      machine.stack[i]=0;
-      machine.program[i]=0;
-    }
-  machine.SP() = VM_SIZE-1;
+  segment_clear( machine.stack );
+  segment_clear( machine.program );
+  machine.SP() = M::size-1;
   machine.IP() = 0;
   machine.W() = 0;
   machine.X() = 1;
   machine.ZF() = 0;
-  
+  machine.heap = guest_heap();
+  machine.automata.clear();
 }
 
-void PUSH_LITERAL ( vm &machine, vm::instruction instr )
+template<class M>
+void PUSH_LITERAL( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
-  machine.stack[machine.SP()--] = c.s_arg;
+  machine.stack[machine.SP()-- & M::mask] = c.s_arg;
   ++machine.IP();
 }
 
-void PUSH_ADDRESS ( vm &machine, vm::instruction instr )
+template<class M>
+void PUSH_ADDRESS( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
-  machine.stack[machine.SP()--] = machine.stack[c.s_arg%(8*1024)];
+  machine.stack[machine.SP()-- & M::mask] = machine.stack[c.s_arg & M::mask];
   ++machine.IP();
 }
 
 
-void POP_ADDRESS( vm &machine, vm::instruction instr )
+template<class M>
+void POP_ADDRESS( M &machine, vm::instruction instr )
 {
   unsigned short addr(vm::convert(instr).s_arg);
-  machine.stack[addr%(8*1024)] = machine.stack[++machine.SP()];
+  machine.stack[addr & M::mask] = machine.stack[++machine.SP() & M::mask];
   ++machine.IP();
 }
 
-void OUCH2( vm &machine, vm::instruction instr )
+// print two characters; a second character of 0 is padding for
+// text of odd length, and is not printed
+template<class M>
+void OUCH2( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   std::cout << c.c_args.c0;
-  std::cout << c.c_args.c1;
+  if( c.c_args.c1 )
+    std::cout << c.c_args.c1;
   ++machine.IP();
 }
 
-void ADD( vm &machine, vm::instruction instr )
+template<class M>
+void ADD( M &machine, vm::instruction instr )
 {
   machine.lookup(instr.dst,instr.dst_mod)
     += machine.lookup(instr.src,instr.src_mod);
   ++machine.IP();
 }
 
-void SUB( vm &machine, vm::instruction instr )
+template<class M>
+void SUB( M &machine, vm::instruction instr )
 {
   machine.lookup( instr.dst, instr.dst_mod )
     -= machine.lookup( instr.src, instr.src_mod );
   ++machine.IP();
 }
 
-void TIMES( vm &machine, vm::instruction instr )
+template<class M>
+void TIMES( M &machine, vm::instruction instr )
 {
   machine.lookup( instr.dst, instr.dst_mod )
     *= machine.lookup( instr.src, instr.src_mod );
@@ -75,7 +85,8 @@ void TIMES( vm &machine, vm::instruction instr )
 
 
 
-void CMP( vm &machine, vm::instruction instr )
+template<class M>
+void CMP( M &machine, vm::instruction instr )
 {
   int lhs = machine.lookup( instr.src, instr.src_mod );
   int rhs = machine.lookup( instr.dst, instr.dst_mod );
@@ -83,7 +94,8 @@ void CMP( vm &machine, vm::instruction instr )
   ++machine.IP();
 }
 
-void JE( vm &machine, vm::instruction instr )
+template<class M>
+void JE( M &machine, vm::instruction instr )
 {
   if( machine.ZF()==1 )
     {
@@ -99,30 +111,35 @@ void JE( vm &machine, vm::instruction instr )
 
 // an x-address can refer to any address, including
 // those in the code segment, on the stack, in registers.
-void JX( vm &machine, vm::instruction instr )
+template<class M>
+void JX( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   machine.X() = ((c.x_args.a_mod & mod_code) > 0)?1:0;
   machine.IP() = c.x_args.a_loc;
 }
 
-void STEP( vm &machine, vm::instruction instr )
+template<class M>
+void STEP( M &machine, vm::instruction instr )
 {
   if( machine.HALTED()==0 )
     { 
+      ++machine.retired;
       if( machine.X()==1 )
-	machine *= vm::to_instruction(machine.program[machine.IP()%VM_SIZE]);
+	machine *= vm::to_instruction(machine.program[machine.IP() & M::mask]);
       else
-	machine *= vm::to_instruction(machine.stack[machine.IP()%VM_SIZE]);
+	machine *= vm::to_instruction(machine.stack[machine.IP() & M::mask]);
     }
 }
 
-void HALT( vm &machine, vm::instruction instr )
+template<class M>
+void HALT( M &machine, vm::instruction instr )
 {
   machine.HALTED()=1;
 }
 
-void RUN( vm &machine, vm::instruction instr )
+template<class M>
+void RUN( M &machine, vm::instruction instr )
 {
   machine.HALTED() = 0;
   while( machine.HALTED() != 1 )
@@ -131,7 +148,8 @@ void RUN( vm &machine, vm::instruction instr )
     }
 }
 
-void RUN_TRACE( vm &machine, vm::instruction instr )
+template<class M>
+void RUN_TRACE( M &machine, vm::instruction instr )
 {
   machine.HALTED() = 0;
   while( machine.HALTED() != 1 )
@@ -141,13 +159,15 @@ void RUN_TRACE( vm &machine, vm::instruction instr )
     }
 }
 
-void JUMP_LITERAL( vm &machine, vm::instruction instr )
+template<class M>
+void JUMP_LITERAL( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   machine.IP() = c.s_arg;
 }
 
-void SETW_LITERAL( vm &machine, vm::instruction instr )
+template<class M>
+void SETW_LITERAL( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   machine.W() = c.s_arg;
@@ -155,13 +175,14 @@ void SETW_LITERAL( vm &machine, vm::instruction instr )
 }
 
 
-void CALL_LITERAL( vm &machine, vm::instruction instr )
+template<class M>
+void CALL_LITERAL( M &machine, vm::instruction instr )
 {
   // make space for return value
   --machine.SP();
   
   // current IP onto stack
-  machine.stack[machine.SP()] = machine.IP() + 1;
+  machine.stack[machine.SP() & M::mask] = machine.IP() + 1;
   --machine.SP();
   
   vm::conversion c(vm::convert(instr));
@@ -172,7 +193,8 @@ void CALL_LITERAL( vm &machine, vm::instruction instr )
 }
 
 // invoke a function whose location is stored in an extended address
-void CALL_ADDRESS( vm &machine, vm::instruction instr )
+template<class M>
+void CALL_ADDRESS( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   // get address stored at specified location
@@ -182,46 +204,51 @@ void CALL_ADDRESS( vm &machine, vm::instruction instr )
   --machine.IP();
   
   // save current IP + 1
-  machine.stack[machine.SP()] = machine.IP()+1;
+  machine.stack[machine.SP() & M::mask] = machine.IP()+1;
   --machine.IP();
   
   // jump to routine
   machine.IP() = address;
 }
 
-void RETURN_LITERAL( vm &machine, vm::instruction instr )
+template<class M>
+void RETURN_LITERAL( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr) );
   // set return value
-  machine.stack[machine.SP()+2] = c.s_arg;
+  machine.stack[(machine.SP()+2) & M::mask] = c.s_arg;
   // jump to return address and remove it from the stack
-  machine.IP() = machine.stack[++machine.SP()];
+  machine.IP() = machine.stack[++machine.SP() & M::mask];
 }
 
-void RETURN_ADDRESS( vm &machine, vm::instruction instr )
+template<class M>
+void RETURN_ADDRESS( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr) );
   // set return value to whatever is pointed by xaddress
-  machine.stack[machine.SP()+2] = machine.lookup( c.x_args.a_loc, c.x_args.a_mod );
+  machine.stack[(machine.SP()+2) & M::mask] = machine.lookup( c.x_args.a_loc, c.x_args.a_mod );
   // jump to return address and remove it from the stack
-  machine.IP() = machine.stack[++machine.SP()];
+  machine.IP() = machine.stack[++machine.SP() & M::mask];
 }
 
-void INC( vm &machine, vm::instruction instr )
+template<class M>
+void INC( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr) );
   ++machine.lookup( c.x_args.a_loc, c.x_args.a_mod );
   ++machine.IP();
 }
 
-void DEC( vm &machine, vm::instruction instr )
+template<class M>
+void DEC( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr) );
   --machine.lookup( c.x_args.a_loc, c.x_args.a_mod );
   ++machine.IP();
 }
 
-void DIV( vm &machine, vm::instruction instr )
+template<class M>
+void DIV( M &machine, vm::instruction instr )
 {
   int divisor(machine.lookup(instr.src,instr.src_mod));
   if( divisor==0 ) throw runtime_error("Division by zero.");
@@ -231,7 +258,8 @@ void DIV( vm &machine, vm::instruction instr )
 }
 
 // print an integer pointed to by an extended address
-void PRINT_ADDRESS_DEC( vm &machine, vm::instruction instr )
+template<class M>
+void PRINT_ADDRESS_DEC( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   int v = machine.lookup( c.x_args.a_loc, c.x_args.a_mod );
@@ -241,7 +269,8 @@ void PRINT_ADDRESS_DEC( vm &machine, vm::instruction instr )
 
 // create a new instruction takes one argument (length),
 // which is the number of instructions that follow.
-void LAMBDA( vm &machine, vm::instruction instr )
+template<class M>
+void LAMBDA( M &machine, vm::instruction instr )
 {
   //std::cout << "Lambda defined.\n";
   vm::conversion c(vm::convert(instr));
@@ -250,11 +279,11 @@ void LAMBDA( vm &machine, vm::instruction instr )
   //  std::cout << "start=" << start << "\n";
   //std::cout << "len=" << len << "\n";
   
-  auto fun = [len,start]( vm &machine, vm::instruction instr )
+  auto fun = [len,start]( M &machine, vm::instruction instr )
     {
       //  std::cout << "Lambda called.\n";
       // save IP address plus 1 ('next line')
-      machine.stack[machine.SP()] = machine.IP()+1;
+      machine.stack[machine.SP() & M::mask] = machine.IP()+1;
       
       --machine.SP();
       
@@ -267,11 +296,12 @@ void LAMBDA( vm &machine, vm::instruction instr )
       // is within the function body.
       while( (machine.IP() >= start) && (machine.IP() < start+len) )
 	{
-	  machine *= vm::to_instruction(machine.program[machine.IP()]);
+	  ++machine.retired;
+	  machine *= vm::to_instruction(machine.program[machine.IP() & M::mask]);
 	}      
       
     };
-  vm::extension x;
+  typename M::extension x;
   x.instr = machine.extensions.size();
   x.fun = fun;
   machine += x;
@@ -280,7 +310,8 @@ void LAMBDA( vm &machine, vm::instruction instr )
 }
 
 
-void LSH( vm &machine, vm::instruction instr )
+template<class M>
+void LSH( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   machine.lookup( c.s_args.a_loc, c.s_args.a_mod )
@@ -288,7 +319,8 @@ void LSH( vm &machine, vm::instruction instr )
   ++machine.IP();
 }
 
-void RSH( vm &machine, vm::instruction instr )
+template<class M>
+void RSH( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   machine.lookup( c.s_args.a_loc, c.s_args.a_mod )
@@ -297,7 +329,8 @@ void RSH( vm &machine, vm::instruction instr )
 } 
 
 
-void AND( vm &machine, vm::instruction instr )
+template<class M>
+void AND( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   machine.lookup( c.i_args.dst, c.i_args.dst_mod )
@@ -305,7 +338,8 @@ void AND( vm &machine, vm::instruction instr )
   ++machine.IP();
 }
 
-void OR( vm &machine, vm::instruction instr )
+template<class M>
+void OR( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   machine.lookup( c.i_args.dst, c.i_args.dst_mod )
@@ -314,75 +348,86 @@ void OR( vm &machine, vm::instruction instr )
 }
 
 // pops IP off of the stack and jumps to it.
-void RETURN_NOTHING( vm &machine, vm::instruction instr )
+template<class M>
+void RETURN_NOTHING( M &machine, vm::instruction instr )
 {
-  machine.IP() = machine.stack[machine.SP()+1];
+  machine.IP() = machine.stack[(machine.SP()+1) & M::mask];
   ++machine.SP(); 
 }
 
 // curses IO
 
-void CURSES_INITSCR( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_INITSCR( M &machine, vm::instruction instr )
 {
   initscr();
   ++machine.IP();
 }
 
-void CURSES_CBREAK( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_CBREAK( M &machine, vm::instruction instr )
 {
   cbreak();
   ++machine.IP();
 }
 
-void CURSES_NOECHO( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_NOECHO( M &machine, vm::instruction instr )
 {
   noecho();
   ++machine.IP();
 }
 
-void CURSES_KEYPAD( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_KEYPAD( M &machine, vm::instruction instr )
 {
   keypad( stdscr, TRUE );
   ++machine.IP();
 }
 
-void CURSES_ENDWIN( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_ENDWIN( M &machine, vm::instruction instr )
 {
   endwin();
   ++machine.IP();
 }
 
-void CURSES_GETCH( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_GETCH( M &machine, vm::instruction instr )
 {
-  machine.stack[ machine.SP() ] = getch();
+  machine.stack[ machine.SP() & M::mask ] = getch();
   --machine.SP();
   ++machine.IP();
 }
 
-void CURSES_WAITCH( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_WAITCH( M &machine, vm::instruction instr )
 {
   int c;
   while( (c=getch())==ERR )
     ;
-  machine.stack[ machine.SP() ] = c;
+  machine.stack[ machine.SP() & M::mask ] = c;
   --machine.SP();
   ++machine.IP();
 }
 
-void CURSES_START_COLOR( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_START_COLOR( M &machine, vm::instruction instr )
 {
   start_color();
   ++machine.IP();
 }
 
-void CURSES_REFRESH( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_REFRESH( M &machine, vm::instruction instr )
 {
   refresh();
   ++machine.IP();
 }
 
 // move cursor to y,x
-void CURSES_MOVE( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_MOVE( M &machine, vm::instruction instr )
 {
   vm::conversion c( vm::convert(instr));
   move( c.c_args.c0, c.c_args.c1 );
@@ -390,7 +435,8 @@ void CURSES_MOVE( vm &machine, vm::instruction instr )
 }
 
 // same as move with registers instead of tiny ints
-void CURSES_MOVE_R( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_MOVE_R( M &machine, vm::instruction instr )
 {
   vm::conversion c( vm::convert(instr) );
   move( machine.lookup( instr.src, instr.src_mod ), 
@@ -398,14 +444,16 @@ void CURSES_MOVE_R( vm &machine, vm::instruction instr )
   ++machine.IP();
 }
 
-void CURSES_ADDCH( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_ADDCH( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   addch( c.c_args.c1 );
   ++machine.IP();
 }
 
-void CURSES_ADD2CH( vm &machine, vm::instruction instr )
+template<class M>
+void CURSES_ADD2CH( M &machine, vm::instruction instr )
 {
   vm::conversion c(vm::convert(instr));
   addch( c.c_args.c0 );
@@ -414,73 +462,302 @@ void CURSES_ADD2CH( vm &machine, vm::instruction instr )
 }
 
 // pushes the curses global 'COLORS' onto the stack
-void CURSES_COLORS( vm &machine, vm::instruction instr )
-{
-  machine.stack[machine.SP()--] = COLORS;
-  ++machine.IP();
-}
-
-void CURSES_COLOR_PAIRS( vm &machine, vm::instruction instr )
-{
-  machine.stack[machine.SP()--] = COLOR_PAIRS;
-  ++machine.IP();
-}
-
-
-
-
-vm
-create_default_vm( stringstream &s )
-{
-  vm machine;
-  machine += RESET;             s << "mnem reset(0)        noargs;" "\n";
-  machine += PUSH_LITERAL;      s << "mnem push-l(1)        short;" "\n";
-  machine += PUSH_ADDRESS;      s << "mnem push-a(2)        short;" "\n";
-  machine += POP_ADDRESS;       s << "mnem pop-a(3)         short;" "\n";
-  machine += OUCH2;             s << "mnem ouch2(4)         chars;" "\n";
-  machine += ADD;               s << "mnem add-r(5)          regs;" "\n";
-  machine += SUB;               s << "mnem sub-r(6)          regs;" "\n";
-  machine += TIMES;             s << "mnem mul-r(7)          regs;" "\n";
-  machine += CMP;               s << "mnem cmp-r(8)          regs;" "\n";
-  machine += JE;                s << "mnem j-e(9)          noargs;" "\n";
-  machine += STEP;              s << "mnem step(10)        noargs;" "\n";
-  machine += HALT;              s << "mnem halt(11)        noargs;" "\n";
-  machine += RUN;               s << "mnem run(12)         noargs;" "\n";
-  machine += RUN_TRACE;         s << "mnem run-trace(13)   noargs;" "\n";
-  machine += JUMP_LITERAL;      s << "mnem jmp-l(14)        short;" "\n";
-  machine += SETW_LITERAL;      s << "mnem setw-l(15)       short;" "\n";
-  machine += CALL_LITERAL;      s << "mnem call-l(16)       short;" "\n";
-  machine += CALL_ADDRESS;      s << "mnem call-x(17)       xaddr;" "\n";
-  machine += RETURN_LITERAL;    s << "mnem return-l(18)     short;" "\n";
-  machine += RETURN_ADDRESS;    s << "mnem return-x(19)     xaddr;" "\n";
-  machine += INC;               s << "mnem inc-x(20)        xaddr;" "\n";
-  machine += DEC;               s << "mnem dec-x(21)        xaddr;" "\n";
-  machine += DIV;               s << "mnem div-r(22)         regs;" "\n";
-  machine += PRINT_ADDRESS_DEC; s << "mnem print-a-d(23)    xaddr;" "\n";
-  machine += LAMBDA;            s << "mnem lambda-l(24)     short;" "\n";
-  machine += AND;               s << "mnem and-r(25)         regs;" "\n";
-  machine += OR;                s << "mnem or-r(26)          regs;" "\n";
-  machine += RETURN_NOTHING;    s << "mnem return(27)      noargs;" "\n";
-  machine += JX;                s << "mnem j-x(28)          xaddr;" "\n";
-  machine += RSH;               s << "mnem rsh(29)         scalar;" "\n";
-  machine += LSH;               s << "mnem lsh(30)         scalar;" "\n";
-
-  machine += CURSES_INITSCR;     s << "mnem curses-initscr(31)     noargs;" "\n";
-  machine += CURSES_CBREAK;      s << "mnem curses-cbreak(32)      noargs;" "\n";
-  machine += CURSES_NOECHO;      s << "mnem curses-noecho(33)      noargs;" "\n";
-  machine += CURSES_KEYPAD;      s << "mnem curses-keypad(34)      noargs;" "\n";
-  machine += CURSES_ENDWIN;      s << "mnem curses-endwin(35)      noargs;" "\n";
-  machine += CURSES_GETCH;       s << "mnem curses-getch(36)       noargs;" "\n";
-  machine += CURSES_WAITCH;      s << "mnem curses-waitch(37)      noargs;" "\n";
-  machine += CURSES_START_COLOR; s << "mnem curses-start-color(38) noargs;" "\n";
-  machine += CURSES_REFRESH;     s << "mnem curses-refresh(39)     noargs;" "\n";
-  machine += CURSES_MOVE;        s << "mnem curses-move(40)         chars;" "\n";
-  machine += CURSES_ADDCH;       s << "mnem curses-addch(41)        chars;" "\n";
-  machine += CURSES_ADD2CH;      s << "mnem curses-add2ch(42)       chars;" "\n";
-  machine += CURSES_COLORS;      s << "mnem curses-colors(43)      noargs;" "\n";
-  machine += CURSES_COLOR_PAIRS; s << "mnem curses-color-pairs(44) noargs;" "\n";
-  machine += CURSES_MOVE_R;      s << "mnem curses-move-r(45)        regs;" "\n";
+template<class M>
+void CURSES_COLORS( M &machine, vm::instruction instr )
+{
+  machine.stack[machine.SP()-- & M::mask] = COLORS;
+  ++machine.IP();
+}
+
+template<class M>
+void CURSES_COLOR_PAIRS( M &machine, vm::instruction instr )
+{
+  machine.stack[machine.SP()-- & M::mask] = COLOR_PAIRS;
+  ++machine.IP();
+}
+
+// the heap: blocks of the stack segment managed natively. Failed
+// allocations set ZF, so j-e can take the failure path.
+
+// heap-init base, words: the heap takes words words of the stack
+// segment from base
+template<class M>
+void HEAP_INIT( M &machine, vm::instruction instr )
+{
+  int base( machine.lookup( instr.src, instr.src_mod ) );
+  int words( machine.lookup( instr.dst, instr.dst_mod ) );
+  if( words < 0 ) throw runtime_error("Negative heap size.");
+  machine.heap.init( base, words, M::size );
+  ++machine.IP();
+}
+
+// alloc words, dst: dst gets the address of a block of at least
+// words words, or 0
+template<class M>
+void ALLOC( M &machine, vm::instruction instr )
+{
+  int words( machine.lookup( instr.src, instr.src_mod ) );
+  int address( words < 0 ? 0 : machine.heap.alloc( words ) );
+  machine.lookup( instr.dst, instr.dst_mod ) = address;
+  machine.ZF() = (address==0)?1:0;
+  ++machine.IP();
+}
+
+// free the block whose address is at an extended address
+template<class M>
+void FREE( M &machine, vm::instruction instr )
+{
+  vm::conversion c(vm::convert(instr));
+  machine.heap.release( machine.lookup( c.x_args.a_loc, c.x_args.a_mod ) );
+  ++machine.IP();
+}
+
+// realloc words, dst: resize the block whose address is in dst,
+// moving it and updating dst if need be. On failure the block and
+// dst are left as they were.
+template<class M>
+void REALLOC( M &machine, vm::instruction instr )
+{
+  int words( machine.lookup( instr.src, instr.src_mod ) );
+  int old( machine.lookup( instr.dst, instr.dst_mod ) );
+  int address(0);
+  if( words < 0 )
+    address = 0;
+  else if( old==0 )
+    address = machine.heap.alloc( words );
+  else if( machine.heap.resize( old, words ) )
+    address = old;
+  else if( (address = machine.heap.alloc( words )) )
+    {
+      unsigned keep( std::min<unsigned>( machine.heap.size_of(old), words ) );
+      for( unsigned i=0; i<keep; ++i )
+	machine.stack[(address+i) & M::mask] = machine.stack[(old+i) & M::mask];
+      machine.heap.release( old );
+    }
+  if( address )
+    machine.lookup( instr.dst, instr.dst_mod ) = address;
+  machine.ZF() = (address==0)?1:0;
+  ++machine.IP();
+}
 
+// push one of the heap's statistics (see guest_heap::stat)
+template<class M>
+void HEAP_STATS( M &machine, vm::instruction instr )
+{
+  vm::conversion c(vm::convert(instr));
+  machine.stack[machine.SP()-- & M::mask] = machine.heap.statistic( c.s_arg );
+  ++machine.IP();
+}
+
+
+// automata: tables saved by compiled_dfa::save, run natively over
+// text in either segment, a character in the low byte of each word.
+// Failures set ZF, as the heap's do.
+
+// dfa-load name, dst: dst gets a handle for the automaton saved in
+// the file whose name is at name in the stack segment, a character
+// a word up to a 0; or 0 if it cannot be loaded, is damaged or is
+// outside the directory guests may load from (see guest_automata)
+template<class M>
+void DFA_LOAD( M &machine, vm::instruction instr )
+{
+  unsigned at( machine.lookup( instr.src, instr.src_mod ) );
+  string name;
+  for( int ch; (ch = machine.stack[at & M::mask] & 0xFF) && name.size() < M::size; ++at )
+    name += char(ch);
+  int handle(0);
+  try
+    {
+      handle = machine.automata.load( name );
+    }
+  catch( runtime_error &e )
+    {
+      handle = 0;
+    }
+  machine.lookup( instr.dst, instr.dst_mod ) = handle;
+  machine.ZF() = (handle==0)?1:0;
+  ++machine.IP();
+}
+
+// run automaton B over the n words from the one a scalar argument
+// names, or over C words if n is 0, and say whether it accepts them
+// all. With longest, the length of the longest prefix it accepts
+// goes in *longest, or -1 if there is none.
+template<class M>
+bool
+run_automaton( M &machine, vm::instruction instr, int *longest )
+{
+  vm::conversion c(vm::convert(instr));
+  compiled_dfa const &d( machine.automata.get( machine.B() ) );
+  unsigned at( machine.where( c.s_args.a_loc, c.s_args.a_mod ) );
+  int n( c.s_args.len ? int(c.s_args.len) : machine.C() );
+  if( n < 0 ) throw runtime_error("Negative text length.");
+  auto &segment( (c.s_args.a_mod & mod_code) ? machine.program : machine.stack );
+
+  // the table is the guest's file, mapped, and could say anything
+  // by now; a target past the last state's row would step outside it
+  const compiled_dfa::index last( (d.states-1)*d.classes );
+  compiled_dfa::index s( d.start );
+  if( longest ) *longest = (s >= d.first_accept) ? 0 : -1;
+  for( int i=0; i<n; ++i )
+    {
+      s = d.next[ s + d.alphabet[ segment[(at+i) & M::mask] & 0xFF ] ];
+      if( s==0 ) return false;
+      if( s > last ) throw runtime_error("Damaged automaton.");
+      if( longest && s >= d.first_accept ) *longest = i+1;
+    }
+  return s >= d.first_accept;
+}
+
+// dfa-match text, n: C gets 1 if automaton B accepts the whole text
+// and 0, with ZF set, if not
+template<class M>
+void DFA_MATCH( M &machine, vm::instruction instr )
+{
+  bool match( run_automaton( machine, instr, nullptr ) );
+  machine.C() = match?1:0;
+  machine.ZF() = match?0:1;
+  ++machine.IP();
+}
+
+// dfa-prefix text, n: C gets the length of the longest prefix of the
+// text that automaton B accepts, or -1 with ZF set if none
+template<class M>
+void DFA_PREFIX( M &machine, vm::instruction instr )
+{
+  int longest(-1);
+  run_automaton( machine, instr, &longest );
+  machine.C() = longest;
+  machine.ZF() = (longest<0)?1:0;
+  ++machine.IP();
+}
+
+
+
+// the built-in instruction set. An instruction's code is its
+// position in this table; the vm, the assembler and the
+// disassembler all read it from here. There is a table for each
+// size of machine, differing only in the functions.
+template<class M>
+struct basic_builtin
+{
+  const char *name;
+  unsigned short code;
+  arg_form form;
+  void (*fun)( M &machine, vm::instruction instr );
+};
+
+template<class M>
+constexpr basic_builtin<M> builtins_for[] =
+  {
+    { "reset",               0, form_noargs, RESET<M> },
+    { "push-l",              1, form_short,  PUSH_LITERAL<M> },
+    { "push-a",              2, form_short,  PUSH_ADDRESS<M> },
+    { "pop-a",               3, form_short,  POP_ADDRESS<M> },
+    { "ouch2",               4, form_chars,  OUCH2<M> },
+    { "add-r",               5, form_regs,   ADD<M> },
+    { "sub-r",               6, form_regs,   SUB<M> },
+    { "mul-r",               7, form_regs,   TIMES<M> },
+    { "cmp-r",               8, form_regs,   CMP<M> },
+    { "j-e",                 9, form_short,  JE<M> },
+    { "step",               10, form_noargs, STEP<M> },
+    { "halt",               11, form_noargs, HALT<M> },
+    { "run",                12, form_noargs, RUN<M> },
+    { "run-trace",          13, form_noargs, RUN_TRACE<M> },
+    { "jmp-l",              14, form_short,  JUMP_LITERAL<M> },
+    { "setw-l",             15, form_short,  SETW_LITERAL<M> },
+    { "call-l",             16, form_short,  CALL_LITERAL<M> },
+    { "call-x",             17, form_xaddr,  CALL_ADDRESS<M> },
+    { "return-l",           18, form_short,  RETURN_LITERAL<M> },
+    { "return-x",           19, form_xaddr,  RETURN_ADDRESS<M> },
+    { "inc-x",              20, form_xaddr,  INC<M> },
+    { "dec-x",              21, form_xaddr,  DEC<M> },
+    { "div-r",              22, form_regs,   DIV<M> },
+    { "print-a-d",          23, form_xaddr,  PRINT_ADDRESS_DEC<M> },
+    { "lambda-l",           24, form_short,  LAMBDA<M> },
+    { "and-r",              25, form_regs,   AND<M> },
+    { "or-r",               26, form_regs,   OR<M> },
+    { "return",             27, form_noargs, RETURN_NOTHING<M> },
+    { "j-x",                28, form_xaddr,  JX<M> },
+    { "rsh",                29, form_scalar, RSH<M> },
+    { "lsh",                30, form_scalar, LSH<M> },
+
+    { "curses-initscr",     31, form_noargs, CURSES_INITSCR<M> },
+    { "curses-cbreak",      32, form_noargs, CURSES_CBREAK<M> },
+    { "curses-noecho",      33, form_noargs, CURSES_NOECHO<M> },
+    { "curses-keypad",      34, form_noargs, CURSES_KEYPAD<M> },
+    { "curses-endwin",      35, form_noargs, CURSES_ENDWIN<M> },
+    { "curses-getch",       36, form_noargs, CURSES_GETCH<M> },
+    { "curses-waitch",      37, form_noargs, CURSES_WAITCH<M> },
+    { "curses-start-color", 38, form_noargs, CURSES_START_COLOR<M> },
+    { "curses-refresh",     39, form_noargs, CURSES_REFRESH<M> },
+    { "curses-move",        40, form_chars,  CURSES_MOVE<M> },
+    { "curses-addch",       41, form_chars,  CURSES_ADDCH<M> },
+    { "curses-add2ch",      42, form_chars,  CURSES_ADD2CH<M> },
+    { "curses-colors",      43, form_noargs, CURSES_COLORS<M> },
+    { "curses-color-pairs", 44, form_noargs, CURSES_COLOR_PAIRS<M> },
+    { "curses-move-r",      45, form_regs,   CURSES_MOVE_R<M> },
+
+    { "heap-init",          46, form_regs,   HEAP_INIT<M> },
+    { "alloc",              47, form_regs,   ALLOC<M> },
+    { "free",               48, form_xaddr,  FREE<M> },
+    { "realloc",            49, form_regs,   REALLOC<M> },
+    { "heap-stats",         50, form_short,  HEAP_STATS<M> },
+
+    { "dfa-load",           51, form_regs,   DFA_LOAD<M> },
+    { "dfa-match",          52, form_scalar, DFA_MATCH<M> },
+    { "dfa-prefix",         53, form_scalar, DFA_PREFIX<M> },
+  };
+
+typedef basic_builtin<vm> builtin;
+inline constexpr auto &builtins = builtins_for<vm>;
+
+constexpr unsigned builtin_count( sizeof(builtins)/sizeof(builtins[0]) );
+
+constexpr bool
+builtins_numbered( unsigned i = 0 )
+{
+  return i==builtin_count
+    || ( builtins[i].code==i && builtins_numbered(i+1) );
+}
+
+static_assert( builtins_numbered(), "built-in codes must match their position in the table" );
+
+constexpr bool
+same_name( const char *a, const char *b )
+{
+  return *a==*b && ( *a==0 || same_name(a+1,b+1) );
+}
+
+// code of the built-in instruction called name. Meant for constant
+// expressions, where an unknown name fails to compile.
+constexpr unsigned short
+builtin_code( const char *name, unsigned i = 0 )
+{
+  return i==builtin_count ? throw std::logic_error("no such built-in instruction")
+    : same_name( builtins[i].name, name ) ? builtins[i].code
+    : builtin_code( name, i+1 );
+}
+
+// the built-in instructions, as the assembler would declare them
+inline void
+describe_default_vm( std::ostream &s )
+{
+  for( const builtin &b : builtins )
+    {
+      s << "mnem " << b.name << "(" << b.code << ") " << form_name(b.form) << ";" "\n";
+    }
+}
+
+template<class M = vm>
+M
+create_default_vm()
+{
+  M machine;
+  for( const basic_builtin<M> &b : builtins_for<M> )
+    {
+      machine += *b.fun;
+    }
   return machine;
 }
 
@@ -1,75 +1,229 @@
 #include <string>
+#include <vector>
 #include <iostream>
+#include <iomanip>
 #include <sstream>
+#include <chrono>
+#include <algorithm>
 
 #include "vm.h"
 #include "vm-default.h"
+#include "disassembler.h"
+#include "perf.h"
 
 using std::stringstream;
 using std::string;
+using std::vector;
 
-// example
+// run to halt with the host's counters on: around the whole run, or,
+// per_opcode, read before and after every instruction and summed by
+// opcode. A user instruction's line includes the lambda body it runs.
+// The report goes to stderr, out of the guest's way.
+template<class M>
+void
+run_counted( M &machine, bool per_opcode )
+{
+  typedef perf_counters::reading reading;
+  perf_counters perf;
+  if( !perf.available() )
+    std::cerr << "h64k-vm: no performance counters (" << perf.why() << "), timing only.\n";
 
-int main(int argc, char **argv)
+  // by opcode: instructions run and what they cost
+  vector<unsigned long> runs;
+  vector<reading> costs;
+  reading overhead{};
+  if( per_opcode && perf.available() )
+    {
+      // the cost of a reading itself, taken off every instruction's
+      perf.start();
+      for( int k=0; k<perf_counters::kinds; ++k ) overhead.value[k] = ~uint64_t(0);
+      for( int i=0; i<1000; ++i )
+	{
+	  reading a( perf.read() ), d( perf.read() - a );
+	  for( int k=0; k<perf_counters::kinds; ++k )
+	    overhead.value[k] = std::min( overhead.value[k], d.value[k] );
+	}
+      perf.stop();
+    }
+
+  unsigned long retired( machine.retired );
+  auto start( std::chrono::steady_clock::now() );
+  perf.start();
+  reading before( perf.read() );
+  try
+    {
+      if( !per_opcode )
+	machine *= vm::assemble(builtin_code("run"));
+      else
+	{
+	  machine.HALTED() = 0;
+	  while( machine.HALTED() != 1 )
+	    {
+	      unsigned ip( machine.IP() & M::mask );
+	      unsigned short op( ( machine.X()==1 ? machine.program[ip] : machine.stack[ip] ) >> 16 & 0xFFFF );
+	      if( op >= runs.size() )
+		{
+		  runs.resize( op+1, 0 );
+		  costs.resize( op+1, reading{} );
+		}
+	      reading a( perf.read() );
+	      STEP( machine, vm::instruction() );
+	      reading d( perf.read() - a );
+	      ++runs[op];
+	      for( int k=0; k<perf_counters::kinds; ++k )
+		costs[op].value[k] += d.value[k] > overhead.value[k] ? d.value[k] - overhead.value[k] : 0;
+	    }
+	}
+    }
+  catch( runtime_error &e )
+    {
+      std::cout << std::endl << e.what() << "\n";
+    }
+  reading total( perf.read() - before );
+  perf.stop();
+  std::chrono::duration<double> took( std::chrono::steady_clock::now() - start );
+  retired = machine.retired - retired;
+
+  std::cerr << std::fixed << std::setprecision(3)
+	    << "\nguest instructions  " << retired
+	    << "\nseconds             " << took.count()
+	    << "\nns per instruction  " << (retired ? 1e9*took.count()/retired : 0) << "\n";
+  for( int k=0; k<perf_counters::kinds; ++k )
+    {
+      perf_counters::kind c( (perf_counters::kind)k );
+      if( !perf.counts(c) ) continue;
+      std::cerr << std::left << std::setw(20) << perf_counters::name(c) << std::right << total.value[k];
+      if( retired )
+	std::cerr << "  (" << double(total.value[k])/retired << " per guest instruction)";
+      std::cerr << "\n";
+    }
+  if( !per_opcode ) return;
+
+  // the costliest opcodes first: by cycles if there are counters,
+  // else by how often they ran
+  vector<unsigned> order;
+  for( unsigned op=0; op<runs.size(); ++op )
+    if( runs[op] ) order.push_back(op);
+  int key( perf.counts(perf_counters::cycles) ? perf_counters::cycles : -1 );
+  std::sort( order.begin(), order.end(), [&]( unsigned a, unsigned b )
+	     {
+	       return key<0 ? runs[a] > runs[b] : costs[a].value[key] > costs[b].value[key];
+	     } );
+  std::cerr << "\n" << std::left << std::setw(20) << "opcode" << std::right << std::setw(12) << "executed";
+  for( int k=0; k<perf_counters::kinds; ++k )
+    if( perf.counts( (perf_counters::kind)k ) )
+      std::cerr << std::setw(16) << perf_counters::name( (perf_counters::kind)k );
+  std::cerr << "  (per instruction)\n";
+  for( unsigned op : order )
+    {
+      string name( op < builtin_count ? builtins_for<M>[op].name : "user " + std::to_string(op) );
+      std::cerr << std::left << std::setw(20) << name << std::right << std::setw(12) << runs[op];
+      for( int k=0; k<perf_counters::kinds; ++k )
+	if( perf.counts( (perf_counters::kind)k ) )
+	  std::cerr << std::setw(16) << double(costs[op].value[k])/runs[op];
+      std::cerr << "\n";
+    }
+}
+
+// run, debug or list an image on a machine of type M
+
+template<class M>
+int
+run_image( string fn, string mode )
 {
-  stringstream preamble;
-  vm machine(create_default_vm(preamble));
-  machine *= vm::assemble(0); // reset.
-  if( argc<2 )
+  M machine(create_default_vm<M>());
+  machine *= vm::assemble(builtin_code("reset"));
+  machine.deserialize(fn);
+
+  if( mode=="dis" )
     {
-      // describe the virtual machine
-      std::cout << preamble.str();
+      // list the program instead of running it
+      disassemble( std::cout, machine );
+      return 0;
+    }
+
+  if( mode=="perf" || mode=="perf-ops" )
+    {
+      run_counted( machine, mode=="perf-ops" );
+      return 0;
     }
-  else if(argc==2)
+
+  if( mode.empty() )
     {
       try
 	{
-	  // deserialize binary image and run it
-	  machine.deserialize(argv[1]);
-	  machine *= vm::assemble(12); // RUN
-	  
+	  machine *= vm::assemble(builtin_code("run"));
 	}
-      catch( runtime_error e )
+      catch( runtime_error &e )
 	{
 	  std::cout << std::endl;
 	  std::cout << e.what() << "\n";
 	}
+      return 0;
     }
-  else if(argc==3)
+
+  string cmd;
+  while( machine.HALTED() != 1 )
     {
-      string fn;
-      if( string(argv[1])=="debug")
-	{
-	  fn = argv[2];
-	}
-      else if( string(argv[2])=="debug")
+      machine.dump_regs();
+      std::cin >> cmd;
+      if( cmd=="step" )
 	{
-	  fn = argv[1];
+	  machine *= vm::assemble(builtin_code("step"));
 	}
-      machine.deserialize(fn);
-
-      string cmd;
-      while( machine.HALTED() != 1 )
+      else if( cmd=="stepn" )
 	{
-	  machine.dump_regs();
-	  std::cin >> cmd;
-	  if( cmd=="step" )
-	    {
-	      machine *= vm::assemble(10);
-	    }
-	  else if( cmd=="stepn" )
+	  int n(0);
+	  std::cin >> n;
+	  for(int i=0; i<n; ++i)
 	    {
-	      int n(0);
-	      std::cin >> n;
-	      for(int i=0; i<n; ++i)
-		{
-		  machine *= vm::assemble(10);
-		  machine.dump_regs();
-		}
+	      machine *= vm::assemble(builtin_code("step"));
+	      machine.dump_regs();
 	    }
 	}
+    }
+  return 0;
+}
 
+int main(int argc, char **argv)
+{
+  if( argc<2 )
+    {
+      // describe the virtual machine
+      describe_default_vm( std::cout );
+      return 0;
     }
 
-  return 0;
+  string fn, mode;
+  if( argc==2 )
+    {
+      fn = argv[1];
+    }
+  else if( string(argv[1])=="debug" || string(argv[1])=="dis"
+	    || string(argv[1])=="perf" || string(argv[1])=="perf-ops" )
+    {
+      mode = argv[1];
+      fn = argv[2];
+    }
+  else
+    {
+      mode = argv[2];
+      fn = argv[1];
+    }
+
+  try
+    {
+      // the image says how big a machine it needs
+      int status(0);
+      with_segment_size( vm::image_words(fn), [&]( auto m )
+	{
+	  status = run_image<typename decltype(m)::type>( fn, mode );
+	} );
+      return status;
+    }
+  catch( runtime_error &e )
+    {
+      std::cout << e.what() << "\n";
+      return 1;
+    }
 }
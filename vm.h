@@ -7,6 +7,11 @@
 #include <sstream>
 #include <stdexcept>
 #include <functional>
+#include <algorithm>
+
+#include "paging.h"
+#include "heap.h"
+#include "automata.h"
 
 
 const int mod_rv(0); // register value             000
@@ -14,13 +19,35 @@ const int mod_ra(1); // register address           001
 const int mod_sv(2); // stack value [sp-addr]      010
 const int mod_sa(3); // stack address [[sp-addr]]  011
 const int mod_code(4); // program segment relative 100
+
+// words in each segment of the default machine
 const int VM_SIZE(8*1024);
 
+// interpretations of an instruction's 16 bit argument
+typedef enum
+  {
+    form_noargs, form_short, form_chars, form_regs, form_xaddr, form_scalar
+  } arg_form;
+
+// the name the assembler uses for a form
+constexpr const char *
+form_name( arg_form f )
+{
+  return f==form_noargs ? "noargs"
+    : f==form_short ? "short"
+    : f==form_chars ? "chars"
+    : f==form_regs ? "regs"
+    : f==form_xaddr ? "xaddr"
+    : "scalar";
+}
+
 using std::string;
 using std::vector;
 using std::runtime_error;
 
-class vm
+// the instruction encoding, which is the same whatever the size of
+// a machine's segments
+class vm_encoding
 {
  public:
   typedef struct
@@ -105,10 +132,155 @@ class vm
   }
     
 
-  //  typedef void (*exec) ( vm &machine, instruction bits );
-  typedef std::function<void(vm &machine, instruction instr) > exec;
+  // an instruction with no argument
+  static instruction
+    assemble( unsigned short code )
+  {
+    instruction ins;    
+    ins.instr = code;
+    ins.src = 0;
+    ins.src_mod = 0;
+    ins.dst = 0;
+    ins.dst_mod = 0;
+    return ins;
+  }
+
+  static instruction
+    assemble( unsigned short code, unsigned short arg )
+  {
+    instruction ins;
+    ins.instr = code;
+    conversion c;
+    c.s_arg = arg;
+    ins.src = c.i_args.src;
+    ins.dst = c.i_args.dst;
+    ins.src_mod = c.i_args.src_mod;
+    ins.dst_mod = c.i_args.dst_mod;
+    return ins;
+  }
+
+  // instruction with two chars
+  static instruction
+    assemble( unsigned short code, char arg0, char arg1 )
+  {
+    instruction ins;
+    ins.instr = code;
+    conversion c;
+    c.c_args.c0 = arg0;
+    c.c_args.c1 = arg1;
+    ins.src = c.i_args.src;
+    ins.dst = c.i_args.dst;
+    ins.src_mod = c.i_args.src_mod;
+    ins.dst_mod = c.i_args.dst_mod;
+    return ins;
+  }
+
+  // instruction with xaddress
+  static instruction
+    assemble_xaddr( unsigned short code, unsigned char mod, unsigned short ind )
+  {
+    instruction ins;
+    ins.instr = code;
+    conversion c;
+    c.x_args.a_mod = mod;
+    c.x_args.a_loc = ind;
+    ins.src_mod = c.i_args.src_mod;
+    ins.dst_mod = c.i_args.dst_mod;
+    ins.src = c.i_args.src;
+    ins.dst = c.i_args.dst;
+    return ins;
+  }
+
+  // instruction with scalar
+  static instruction
+    assemble_scalar( unsigned short code, unsigned char mod, unsigned short ind, unsigned int len )
+    {
+      instruction ins;
+      ins.instr = code;
+      conversion c;
+      c.s_args.a_mod = mod;
+      c.s_args.a_loc = ind;
+      c.s_args.len = len;
+      ins.dst_mod = c.i_args.dst_mod;
+      ins.src_mod = c.i_args.src_mod;
+      ins.src = c.i_args.src;
+      ins.dst = c.i_args.dst;
+      return ins;
+    }
+
+  static instruction
+    dw( unsigned char c0, unsigned char c1, unsigned char c2, unsigned char c3 )
+  {    
+    return to_instruction( (c0<<24)|(c1<<16)|(c2<<8)|c3 );
+  }
+};
+
+// what a machine needs from the storage behind a segment, beyond
+// operator[]. Plain vectors keep every word in memory;
+// paged_segment (paging.h) keeps some of them.
+inline void
+segment_clear( vector<int> &s )
+{
+  std::fill( s.begin(), s.end(), 0 );
+}
 
-  typedef void (&exec_ref) ( vm &machine, instruction bits );
+// one past the last word that might not be zero
+inline unsigned
+segment_used( vector<int> const &s )
+{
+  return s.size();
+}
+
+// vectors read their whole image up front
+inline bool
+segment_attach( vector<int> &, string const &, std::streamoff, unsigned, unsigned )
+{
+  return false;
+}
+
+template<unsigned Words, unsigned PageWords>
+void
+segment_clear( paged_segment<Words,PageWords> &s )
+{
+  s.clear();
+}
+
+template<unsigned Words, unsigned PageWords>
+unsigned
+segment_used( paged_segment<Words,PageWords> const &s )
+{
+  return s.used();
+}
+
+template<unsigned Words, unsigned PageWords>
+bool
+segment_attach( paged_segment<Words,PageWords> &s, string const &name,
+		std::streamoff offset, unsigned step, unsigned words )
+{
+  s.attach( name, offset, step, words );
+  return true;
+}
+
+// a machine whose segments hold Words words each. Addresses wrap
+// around a segment, so Words must be a power of two.
+//
+// Direct addresses reach only the first 8K words, so Y and Z are
+// base registers: a direct stack address past the registers is
+// relative to Y, and a direct program address to Z.
+template<unsigned Words, class Segment = vector<int> >
+class basic_vm : public vm_encoding
+{
+  static_assert( Words >= 64 && (Words & (Words-1))==0,
+		 "segments must be a power of two and have room for the registers" );
+ public:
+  static const unsigned size = Words;
+  static const unsigned mask = Words-1;
+  // direct stack addresses below this are registers, not memory
+  static const unsigned registers = 64;
+
+  typedef std::function<void(basic_vm &machine, instruction instr) > exec;
+
+  typedef void (&exec_ref) ( basic_vm &machine, instruction bits );
 
   typedef struct
   {
@@ -116,36 +288,73 @@ class vm
     unsigned short instr;
   } extension;
 
-  // 64kb machine image
-  int stack[VM_SIZE];
-  int program[VM_SIZE];
+  // the machine image, kept off the C++ stack so big machines fit
+  Segment stack;
+  Segment program;
 
   vector<extension> extensions;
+
+  // blocks handed out by alloc, in the stack segment
+  guest_heap heap;
+
+  // automata loaded by dfa-load
+  guest_automata automata;
+
+  // guest instructions executed since the machine was made: each
+  // one step fetches, and each one run inside a lambda's body
+  unsigned long retired;
   
-  vm()
+  basic_vm()
+    : stack(Words), program(Words), retired(0)
     {
-      IP() = VM_SIZE-1;
+      IP() = Words-1;
       X() = 1;
     }
 
+  // images start with "H64K" and the segment size, then the two
+  // segments a word of each at a time. Words missing from the end
+  // of an image are zero. Images without a header are the original
+  // 8K word machine.
+  static unsigned
+    image_words( string name )
+  {
+    std::ifstream fs(name, std::ios::binary);
+    if( !fs )
+      throw runtime_error("Could not open " + name + ".");
+    char magic[4];
+    if( !fs.read( magic, 4 ) || string(magic,4) != "H64K" )
+      return 8*1024;
+    unsigned char b[4];
+    if( !fs.read( reinterpret_cast<char*>(b), 4 ) )
+      throw runtime_error("Truncated image " + name + ".");
+    return b[0] | (b[1]<<8) | (b[2]<<16) | (unsigned(b[3])<<24);
+  }
+
   void
     serialize( string name )
   {
+    unsigned n( std::max( segment_used(stack), segment_used(program) ) );
+    while( n > 0 && stack[n-1]==0 && program[n-1]==0 )
+      --n;
+
     std::ofstream fs(name, std::ios::binary);
-    for(int i=0; i<VM_SIZE; ++i)
+    fs.write( "H64K", 4 );
+    for( int shift=0; shift<32; shift+=8 )
+      fs.put( (Words>>shift) & 0xFF );
+
+    vector<char> buf;
+    buf.reserve( 8*1024 );
+    for(unsigned i=0; i<n; ++i)
       {
-	char *s = reinterpret_cast<char*>(&stack[i]);
-	char *p = reinterpret_cast<char*>(&program[i]);
-
-	fs.put( *(s+0) );
-	fs.put( *(s+1) );
-	fs.put( *(s+2) );
-	fs.put( *(s+3) );		
-
-	fs.put( *(p+0) );
-	fs.put( *(p+1) );
-	fs.put( *(p+2) );
-	fs.put( *(p+3) );		
+	unsigned w[2] = { unsigned(stack[i]), unsigned(program[i]) };
+	for( unsigned v : w )
+	  for( int shift=0; shift<32; shift+=8 )
+	    buf.push_back( (v>>shift) & 0xFF );
+	if( buf.size() >= 8*1024 || i+1==n )
+	  {
+	    fs.write( buf.data(), buf.size() );
+	    buf.clear();
+	  }
       }
     fs.flush();
     fs.close();
@@ -154,22 +363,37 @@ class vm
   void
     deserialize( string name )
   {
-    std::ifstream fs(name, std::ios::binary);
-    for(int i=0; i<VM_SIZE; ++i)
+    if( image_words(name) != Words )
+      {
+	std::stringstream s;
+	s << name << " is an image for " << image_words(name)
+	  << " word segments, not " << Words << ".";
+	throw runtime_error(s.str());
+      }
+    std::ifstream fs(name, std::ios::binary | std::ios::ate);
+    std::streamoff length( fs.tellg() ), header(0);
+    fs.seekg(0);
+    char magic[4];
+    if( fs.read( magic, 4 ) && string(magic,4) == "H64K" )
+      header = 8;
+    unsigned present( std::min<std::streamoff>( (length-header)/8, Words ) );
+
+    // paged segments read the image as they touch it
+    bool s_lazy( segment_attach( stack, name, header, 8, present ) );
+    bool p_lazy( segment_attach( program, name, header+4, 8, present ) );
+    if( s_lazy && p_lazy )
+      return;
+
+    segment_clear(stack);
+    segment_clear(program);
+    fs.seekg(header);
+    vector<unsigned char> buf( std::size_t(present)*8 );
+    fs.read( reinterpret_cast<char*>(buf.data()), buf.size() );
+    for(unsigned i=0; i<present; ++i)
       {
-	char *s = reinterpret_cast<char*>(&stack[i]);
-	char *p = reinterpret_cast<char*>(&program[i]);
-	
-	*(s+0) = fs.get();
-	*(s+1) = fs.get();
-	*(s+2) = fs.get();
-	*(s+3) = fs.get();
-	*(p+0) = fs.get();
-	*(p+1) = fs.get();
-	*(p+2) = fs.get();
-	*(p+3) = fs.get();
-      
-	//	std::cout << "Program[" << i << "]=" << program[i] << "\n";
+	const unsigned char *b( &buf[i*8] );
+	stack[i] = b[0] | (b[1]<<8) | (b[2]<<16) | (unsigned(b[3])<<24);
+	program[i] = b[4] | (b[5]<<8) | (b[6]<<16) | (unsigned(b[7])<<24);
       }
     fs.close();
   }
@@ -181,26 +405,6 @@ class vm
     return instr < extensions.size();
   }
 
-  // execute (immediately) an instruction on a virtual machine
-  friend vm & 
-    operator*= ( vm &machine, instruction ins );
-
-  
-
-  // augment a virtual machine with a new instruction type
-  friend vm &
-    operator+= ( vm &machine, extension &ext );
-
-  // augment a virtual machine with a new instruction type
-  // based on a function
-  friend vm &
-    operator+= ( vm &machine, exec_ref ext );
-  
-  // store an instruction as program[W] and increment W
-  friend vm &
-    operator<< ( vm &machine, instruction ins );
-  
-  
   // registers are at the bottom of the stack.
   // some of them have names
 
@@ -255,124 +459,106 @@ class vm
 	      << "W=" << W() << "\n";
   }
 
-  // an instruction with no argument
-  static instruction
-    assemble( unsigned short code )
-  {
-    instruction ins;    
-    ins.instr = code;
-    ins.src = 0;
-    ins.src_mod = 0;
-    ins.dst = 0;
-    ins.dst_mod = 0;
-    return ins;
-  }
-
-  static instruction
-    assemble( unsigned short code, unsigned short arg )
-  {
-    instruction ins;
-    ins.instr = code;
-    conversion c;
-    c.s_arg = arg;
-    ins.src = c.i_args.src;
-    ins.dst = c.i_args.dst;
-    ins.src_mod = c.i_args.src_mod;
-    ins.dst_mod = c.i_args.dst_mod;
-    return ins;
-  }
-
-  // instruction with two chars
-  static instruction
-    assemble( unsigned short code, char arg0, char arg1 )
-  {
-    instruction ins;
-    ins.instr = code;
-    conversion c;
-    c.c_args.c0 = arg0;
-    c.c_args.c1 = arg1;
-    ins.src = c.i_args.src;
-    ins.dst = c.i_args.dst;
-    ins.src_mod = c.i_args.src_mod;
-    ins.dst_mod = c.i_args.dst_mod;
-    return ins;
-  }
-
-  // instruction with xaddress
-  static instruction
-    assemble_xaddr( unsigned short code, unsigned char mod, unsigned short ind )
-  {
-    instruction ins;
-    ins.instr = code;
-    conversion c;
-    c.x_args.a_mod = mod;
-    c.x_args.a_loc = ind;
-    ins.src_mod = c.i_args.src_mod;
-    ins.dst_mod = c.i_args.dst_mod;
-    ins.src = c.i_args.src;
-    ins.dst = c.i_args.dst;
-    return ins;
-  }
-
-  // instruction with scalar
-  static instruction
-    assemble_scalar( unsigned short code, unsigned char mod, unsigned short ind, unsigned int len )
-    {
-      instruction ins;
-      ins.instr = code;
-      conversion c;
-      c.s_args.a_mod = mod;
-      c.s_args.a_loc = ind;
-      c.s_args.len = len;
-      ins.dst_mod = c.i_args.dst_mod;
-      ins.src_mod = c.i_args.src_mod;
-      ins.src = c.i_args.src;
-      ins.dst = c.i_args.dst;
-      return ins;
-    }
-
-  static instruction
-    dw( unsigned char c0, unsigned char c1, unsigned char c2, unsigned char c3 )
-  {    
-    return to_instruction( (c0<<24)|(c1<<16)|(c2<<8)|c3 );
-  }
-    
   int & lookup( unsigned short address, unsigned char mode )
   {  
     switch(mode)
       {
       case mod_rv: // look up a register value
-	return stack[address];
+	return stack[ address<registers ? address : (Y()+address)&mask ];
       case mod_ra: // look up the value of an address via register
-	return stack[stack[address]%VM_SIZE];
+	return stack[stack[address&mask]&mask];
       case mod_sv: // look up a stack value
-	return stack[(SP()+address)%VM_SIZE];
+	return stack[(SP()+address)&mask];
       case mod_sa: // look up a value pointed to by stack value
-	return stack[stack[(SP()+address)%VM_SIZE]];
+	return stack[stack[(SP()+address)&mask]&mask];
       case mod_code + mod_rv:
-	return program[address%VM_SIZE];
+	return program[(Z()+address)&mask];
       case mod_code + mod_ra:
-	return program[stack[address%VM_SIZE]%VM_SIZE];
+	return program[stack[address&mask]&mask];
       case mod_code + mod_sv:
-	return program[(SP()+address)%VM_SIZE];
+	return program[(SP()+address)&mask];
       case mod_code + mod_sa:
-	return program[stack[(SP()+address)%VM_SIZE]%VM_SIZE];
+	return program[stack[(SP()+address)&mask]&mask];
       default:   
 	throw runtime_error("Invalid addressing mode.");
       }
   }
+
+  // where in its segment the word lookup( address, mode ) refers to
+  // is; the segment is the program segment if mode has mod_code
+  unsigned
+    where( unsigned short address, unsigned char mode )
+  {
+    switch(mode)
+      {
+      case mod_rv:
+	return address<registers ? address : (Y()+address)&mask;
+      case mod_code + mod_rv:
+	return (Z()+address)&mask;
+      case mod_ra:
+      case mod_code + mod_ra:
+	return stack[address&mask]&mask;
+      case mod_sv:
+      case mod_code + mod_sv:
+	return (SP()+address)&mask;
+      case mod_sa:
+      case mod_code + mod_sa:
+	return stack[(SP()+address)&mask]&mask;
+      default:
+	throw runtime_error("Invalid addressing mode.");
+      }
+  }
 };
 
+typedef basic_vm<VM_SIZE> vm;
+
+// the segment sizes the tools build machines for
+template<unsigned Words, class Segment = vector<int> >
+struct machine_of
+{
+  typedef basic_vm<Words,Segment> type;
+};
 
+// call f with a machine_of tag for a machine with words word
+// segments, e.g.
+//
+//   with_segment_size( words, [&]( auto m )
+//     {
+//       typename decltype(m)::type machine;
+//       ...
+//     } );
+template<class F>
+void
+with_segment_size( unsigned words, F f )
+{
+  switch( words )
+    {
+    case 1024:      f( machine_of<1024>() ); break;
+    case 8*1024:    f( machine_of<8*1024>() ); break;
+    case 64*1024:   f( machine_of<64*1024>() ); break;
+    case 1024*1024: f( machine_of<1024*1024>() ); break;
+      // too big to keep in memory
+    case 16*1024*1024:
+      f( machine_of< 16*1024*1024, paged_segment<16*1024*1024> >() );
+      break;
+    default:
+      {
+	std::stringstream s;
+	s << "No machine with " << words << " word segments; try 1024, 8192, 65536, 1048576 or 16777216.";
+	throw runtime_error(s.str());
+      }
+    }
+}
 
-vm &
-operator *= (vm &machine, vm::instruction ins )
+// execute (immediately) an instruction on a virtual machine
+template<unsigned Words, class Segment>
+basic_vm<Words,Segment> &
+operator *= (basic_vm<Words,Segment> &machine, vm_encoding::instruction ins )
 {
   if( !machine.HALTED() )
     {
       if( machine.is_op( ins.instr ) )
 	{
-	  //      machine.program[machine.IP()%8*1024] = vm::int32(ins);
 	  machine.extensions[ins.instr].fun( machine, ins );
 	}
       else
@@ -386,28 +572,35 @@ operator *= (vm &machine, vm::instruction ins )
   
 }
 
-vm &
-operator += (vm &machine, vm::extension &ext )
+// augment a virtual machine with a new instruction type
+template<unsigned Words, class Segment>
+basic_vm<Words,Segment> &
+operator += (basic_vm<Words,Segment> &machine, typename basic_vm<Words,Segment>::extension &ext )
 {
   machine.extensions.push_back(ext);
   ext.instr = machine.extensions.size()-1;
   return machine;
 }
 
-vm &
-operator += (vm &machine, vm::exec_ref fn )
+// augment a virtual machine with a new instruction type
+// based on a function
+template<unsigned Words, class Segment>
+basic_vm<Words,Segment> &
+operator += (basic_vm<Words,Segment> &machine, typename basic_vm<Words,Segment>::exec_ref fn )
 {
-  vm::extension ext;
+  typename basic_vm<Words,Segment>::extension ext;
   ext.fun = &fn;
   machine += ext;
   return machine;
 }
 
-vm &
-operator << (vm &machine, vm::instruction ins )
+// store an instruction as program[W] and increment W
+template<unsigned Words, class Segment>
+basic_vm<Words,Segment> &
+operator << (basic_vm<Words,Segment> &machine, vm_encoding::instruction ins )
 {
-  machine.program[machine.W()] = vm::int32(ins);
-  machine.W() = (machine.W()+1) % (8*1024);
+  machine.program[machine.W() & basic_vm<Words,Segment>::mask] = vm_encoding::int32(ins);
+  machine.W() = (machine.W()+1) & basic_vm<Words,Segment>::mask;
   return machine;
 }
 